@@ -19,13 +19,50 @@
 #include <linux/init.h>
 
 #include <linux/kernel.h>	/* printk() */
-#include <linux/slab.h>		/* kmalloc() */
+#include <linux/slab.h>		/* kmalloc(), kmem_cache */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/cdev.h>
 #include <linux/list.h>    /* Linked List */
+#include <linux/rculist.h>
+#include <linux/llist.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/tracepoint.h>
+#include <linux/shrinker.h>
+#include <linux/pid.h>
+#include <linux/cgroup.h>
+#include <linux/hashtable.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+#include <linux/seqlock.h>
+#include <linux/mm.h>		/* kvmalloc() */
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/jump_label.h>
+#include <linux/stacktrace.h>
+#include <linux/overflow.h>	/* struct_size() */
+#include <linux/anon_inodes.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>	/* set_active_memcg() */
+#include <linux/sizes.h>
+#include <linux/io.h>		/* virt_to_phys() */
+#include <linux/eventfd.h>
+#include <linux/sched/signal.h>	/* for_each_process_thread() */
 
 
 #include <linux/uaccess.h>	/* copy_*_user */
@@ -39,42 +76,3542 @@
 static int scull_major =   SCULL_MAJOR;
 static int scull_minor =   0;
 static int scull_quantum = SCULL_QUANTUM;
+static int scull_follow_prealloc = 64;	/* nodes kept ready for the fork probe */
+static unsigned int scull_rate_limit = 0;	/* snapshot ioctls/s per open, 0 = off */
+static unsigned int scull_rate_burst = 16;
+static bool scull_defer_insert = true;	/* insert from a work item, not the ioctl */
+static char *scull_backend = "xarray";	/* list, hash or xarray */
+static unsigned int scull_switch_history = 256;	/* records per CPU ring */
+static unsigned int scull_wake_edges = 4096;	/* waker->wakee edge table size */
+static unsigned int scull_offcpu_slots = 4096;	/* (task, stack) table size */
+static unsigned int scull_stuck_ms = 10000;	/* watchdog threshold */
+static unsigned int scull_sample_ms = 1000;	/* sampler period */
+static unsigned int scull_sample_ring_mb = 4;	/* sample ring size, 0 = none */
+static unsigned int scull_tombstones = 4096;	/* deletes kept for SCULL_IOCSINCE */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
+module_param(scull_follow_prealloc, int, S_IRUGO);
+module_param(scull_rate_limit, uint, S_IRUGO);
+module_param(scull_rate_burst, uint, S_IRUGO);
+module_param(scull_defer_insert, bool, S_IRUGO);
+module_param(scull_backend, charp, S_IRUGO);
+module_param(scull_switch_history, uint, S_IRUGO);
+module_param(scull_wake_edges, uint, S_IRUGO);
+module_param(scull_offcpu_slots, uint, S_IRUGO);
+module_param(scull_stuck_ms, uint, S_IRUGO | S_IWUSR);
+module_param(scull_sample_ms, uint, S_IRUGO | S_IWUSR);
+module_param(scull_sample_ring_mb, uint, S_IRUGO);
+module_param(scull_tombstones, uint, S_IRUGO);
+
+/*
+ * Optional features, each behind a static key so that a disabled feature
+ * costs a patched-out NOP on the fast path rather than a load and test.
+ * A feature that needs sched tracepoints holds their probes attached while
+ * it is on: with none on, the scheduler never calls into the module at all.
+ * They are toggled at run time through
+ * /sys/module/scull/parameters/scull_feature_<name>.
+ */
+struct scull_feature {
+	bool enabled;
+	struct static_key_false *key;
+	unsigned int probes;	/* BIT(SCULL_TPI_*) of the tracepoints it uses */
+	void (*reset)(void);	/* forget what it gathered, when turned on */
+};
+
+/* Indices into scull_tracepoints[] */
+enum { SCULL_TPI_FORK, SCULL_TPI_EXIT, SCULL_TPI_SWITCH, SCULL_TPI_WAKING };
+
+static DEFINE_MUTEX(scull_tp_mutex);	/* probe users, feature transitions */
+static int scull_probes_get(unsigned int probes);
+static void scull_probes_put(unsigned int probes);
+static void scull_wake_reset(void);
+static void scull_offcpu_reset(void);
+
+static int scull_feature_set(const char *val, const struct kernel_param *kp)
+{
+	struct scull_feature *feature = kp->arg;
+	bool on;
+	int ret;
+
+	ret = kstrtobool(val, &on);
+	if (ret)
+		return ret;
+	mutex_lock(&scull_tp_mutex);
+	if (on && !feature->enabled) {
+		ret = scull_probes_get(feature->probes);
+		if (!ret) {
+			if (feature->reset)
+				feature->reset();
+			feature->enabled = true;
+			static_branch_enable(feature->key);
+		}
+	} else if (!on && feature->enabled) {
+		feature->enabled = false;
+		static_branch_disable(feature->key);
+		scull_probes_put(feature->probes);
+	}
+	mutex_unlock(&scull_tp_mutex);
+	return ret;
+}
+
+static int scull_feature_get(char *buffer, const struct kernel_param *kp)
+{
+	struct scull_feature *feature = kp->arg;
+
+	return sprintf(buffer, "%c\n", feature->enabled ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops scull_feature_ops = {
+	.set = scull_feature_set,
+	.get = scull_feature_get,
+};
+
+#define SCULL_FEATURE(name, on, tps, rst)				\
+	static DEFINE_STATIC_KEY_FALSE(scull_##name##_key);		\
+	static struct scull_feature scull_feature_##name = {		\
+		.enabled = on, .key = &scull_##name##_key, .probes = tps, \
+		.reset = rst,						\
+	};								\
+	module_param_cb(scull_feature_##name, &scull_feature_ops,	\
+			&scull_feature_##name, S_IRUGO | S_IWUSR)
+
+#define SCULL_TPB(name)	BIT(SCULL_TPI_##name)
+
+SCULL_FEATURE(stats, true, 0, NULL);		/* fast-path hit/miss counters */
+SCULL_FEATURE(follow, true, SCULL_TPB(FORK), NULL);	/* SCULL_IOCTFOLLOW */
+SCULL_FEATURE(ratelimit, false, 0, NULL);	/* per-open token bucket */
+SCULL_FEATURE(refresh, true, 0, NULL);		/* repeat calls update their entry */
+SCULL_FEATURE(cpustat, false, SCULL_TPB(SWITCH), NULL);	/* per-CPU curr/switches */
+SCULL_FEATURE(history, false, SCULL_TPB(SWITCH), NULL);	/* per-CPU run history */
+SCULL_FEATURE(wakeup, false, SCULL_TPB(SWITCH) | SCULL_TPB(WAKING),
+	      scull_wake_reset);			/* waker->wakee graph */
+SCULL_FEATURE(offcpu, false, SCULL_TPB(SWITCH),
+	      scull_offcpu_reset);			/* off-CPU time per stack */
+
+static struct scull_feature *scull_features[] = {
+	&scull_feature_stats,
+	&scull_feature_follow,
+	&scull_feature_ratelimit,
+	&scull_feature_refresh,
+	&scull_feature_cpustat,
+	&scull_feature_history,
+	&scull_feature_wakeup,
+	&scull_feature_offcpu,
+};
+
+/* Called from process context */
+static void scull_feature_enable(struct scull_feature *feature)
+{
+	feature->enabled = true;
+	static_branch_enable(feature->key);
+}
+
+/*
+ * Load-time defaults never go through scull_feature_set(), and values set
+ * on the command line go through it before the tracepoints are looked up:
+ * attach the probes of everything enabled so far here, once they are.
+ */
+static void scull_features_init(void)
+{
+	struct scull_feature *feature;
+	int i;
+
+	mutex_lock(&scull_tp_mutex);
+	if (scull_rate_limit)
+		scull_feature_ratelimit.enabled = true;
+	for (i = 0; i < ARRAY_SIZE(scull_features); i++) {
+		feature = scull_features[i];
+		if (!feature->enabled)
+			continue;
+		if (scull_probes_get(feature->probes)) {
+			feature->enabled = false;
+			static_branch_disable(feature->key);
+			continue;
+		}
+		static_branch_enable(feature->key);
+	}
+	mutex_unlock(&scull_tp_mutex);
+}
 
 MODULE_AUTHOR("Burak Yesil");
 MODULE_LICENSE("Dual BSD/GPL");
 
 
-struct task_info_node {
-    pid_t pid;
-    pid_t tgid;
-    struct list_head list;
-};
+/* task_info_node.flags bits */
+#define SCULL_NODE_FOLLOW	0	/* register children and threads at fork */
+#define SCULL_NODE_EXITED	1	/* seen by the sched_process_exit probe */
+#define SCULL_NODE_STUCK	2	/* reported by the watchdog */
+#define SCULL_NODE_POOL		3	/* taken from the follow pool, not yet replaced */
+
+struct task_info_node {
+    pid_t pid;
+    pid_t tgid;
+    unsigned long flags;
+    u64 cgid;		/* cgroup (v2) the node is counted against */
+    seqlock_t lock;	/* protects info */
+    struct task_info info;	/* last snapshot taken of the task */
+    u64 wake_ns;		/* sched_waking time, 0 once it ran */
+    pid_t waker;
+    u64 off_ns;			/* switched out asleep at, 0 while on CPU */
+    u32 off_stack;		/* scull_stack_table handle, 0 if none */
+    unsigned long watch_csw;	/* nvcsw + nivcsw at the last watchdog scan */
+    unsigned long watch_since;	/* jiffies since watch_csw is unchanged */
+    u64 sample_migr;		/* se.nr_migrations at the last sample */
+    unsigned long sample_nivcsw;	/* nivcsw at the last sample */
+    u64 gen;			/* scull_generation at insert or last change */
+    struct list_head list;	/* scull_node_pool, or the list backend */
+    struct hlist_node hash;	/* hash backend */
+    struct llist_node pending;
+    struct rcu_head rcu;
+};
+
+/*
+ * The registry: a map from pid to node behind a small ops table, so the
+ * data structure can be picked at load time (scull_backend) and compared.
+ * Every backend supports lockless lookup and walk under RCU; insert and
+ * erase are called with task_info_node_mutex held, which also keeps
+ * compound updates (counters, replacing an entry whose pid was reused)
+ * consistent. Everything above the ops table is backend-agnostic.
+ */
+struct scull_registry_ops {
+	const char *name;
+	bool ordered;		/* walk() visits pids in increasing order */
+	int  (*init)(void);
+	void (*destroy)(void);
+	struct task_info_node *(*lookup)(pid_t pid);
+	int  (*insert)(struct task_info_node *node);
+	void (*erase)(struct task_info_node *node);
+	/* Visit nodes with pid >= start until fn returns false */
+	void (*walk)(pid_t start, bool (*fn)(struct task_info_node *node, void *arg),
+		     void *arg);
+};
+
+static const struct scull_registry_ops *scull_ops;
+static DEFINE_MUTEX(task_info_node_mutex);
+
+/* list: the original linked list, O(n) lookups */
+static LIST_HEAD(scull_list_registry);
+
+static struct task_info_node *scull_list_lookup(pid_t pid)
+{
+	struct task_info_node *node;
+
+	list_for_each_entry_rcu(node, &scull_list_registry, list) {
+		if (node->pid == pid)
+			return node;
+	}
+	return NULL;
+}
+
+static int scull_list_insert(struct task_info_node *node)
+{
+	list_add_tail_rcu(&node->list, &scull_list_registry);
+	return 0;
+}
+
+static void scull_list_erase(struct task_info_node *node)
+{
+	list_del_rcu(&node->list);
+}
+
+static void scull_list_walk(pid_t start, bool (*fn)(struct task_info_node *, void *),
+			    void *arg)
+{
+	struct task_info_node *node;
+
+	list_for_each_entry_rcu(node, &scull_list_registry, list) {
+		if (node->pid >= start && !fn(node, arg))
+			break;
+	}
+}
+
+static const struct scull_registry_ops scull_list_ops = {
+	.name   = "list",
+	.lookup = scull_list_lookup,
+	.insert = scull_list_insert,
+	.erase  = scull_list_erase,
+	.walk   = scull_list_walk,
+};
+
+/* hash: fixed-size RCU hash table */
+#define SCULL_HASH_BITS 12
+
+static DEFINE_HASHTABLE(scull_hash_registry, SCULL_HASH_BITS);
+
+static struct task_info_node *scull_hash_lookup(pid_t pid)
+{
+	struct task_info_node *node;
+
+	hash_for_each_possible_rcu(scull_hash_registry, node, hash, pid) {
+		if (node->pid == pid)
+			return node;
+	}
+	return NULL;
+}
+
+static int scull_hash_insert(struct task_info_node *node)
+{
+	hash_add_rcu(scull_hash_registry, &node->hash, node->pid);
+	return 0;
+}
+
+static void scull_hash_erase(struct task_info_node *node)
+{
+	hash_del_rcu(&node->hash);
+}
+
+static void scull_hash_walk(pid_t start, bool (*fn)(struct task_info_node *, void *),
+			    void *arg)
+{
+	struct task_info_node *node;
+	int bkt;
+
+	hash_for_each_rcu(scull_hash_registry, bkt, node, hash) {
+		if (node->pid >= start && !fn(node, arg))
+			return;
+	}
+}
+
+static const struct scull_registry_ops scull_hash_ops = {
+	.name   = "hash",
+	.lookup = scull_hash_lookup,
+	.insert = scull_hash_insert,
+	.erase  = scull_hash_erase,
+	.walk   = scull_hash_walk,
+};
+
+/* xarray: indexed by pid, compact for dense pid ranges, ordered walks */
+static DEFINE_XARRAY(scull_xa_registry);
+
+static struct task_info_node *scull_xa_lookup(pid_t pid)
+{
+	return xa_load(&scull_xa_registry, pid);
+}
+
+static int scull_xa_insert(struct task_info_node *node)
+{
+	return xa_insert(&scull_xa_registry, node->pid, node, GFP_KERNEL);
+}
+
+static void scull_xa_erase(struct task_info_node *node)
+{
+	xa_erase(&scull_xa_registry, node->pid);
+}
+
+static void scull_xa_walk(pid_t start, bool (*fn)(struct task_info_node *, void *),
+			  void *arg)
+{
+	struct task_info_node *node;
+	unsigned long index = start;
+
+	for (node = xa_find(&scull_xa_registry, &index, PID_MAX_LIMIT, XA_PRESENT); node;
+	     node = xa_find_after(&scull_xa_registry, &index, PID_MAX_LIMIT, XA_PRESENT)) {
+		if (!fn(node, arg))
+			break;
+	}
+}
+
+static void scull_xa_destroy(void)
+{
+	xa_destroy(&scull_xa_registry);
+}
+
+static const struct scull_registry_ops scull_xa_ops = {
+	.name    = "xarray",
+	.ordered = true,
+	.destroy = scull_xa_destroy,
+	.lookup  = scull_xa_lookup,
+	.insert  = scull_xa_insert,
+	.erase   = scull_xa_erase,
+	.walk    = scull_xa_walk,
+};
+
+static const struct scull_registry_ops *scull_backends[] = {
+	&scull_list_ops,
+	&scull_hash_ops,
+	&scull_xa_ops,
+};
+
+static atomic_long_t scull_nr_nodes = ATOMIC_LONG_INIT(0);
+
+/*
+ * Membership filter in front of the registry: one bit per possible pid,
+ * set while the pid has an entry (or one queued for insert) and cleared
+ * when the task exits or its entry is deleted, so repeat callers of
+ * SCULL_IOCIQUANTUM are answered by test_bit() alone. The shrinker's
+ * referenced bits live in a second bitmap so that a hit writes nothing
+ * shared unless the bit actually has to be set.
+ */
+static unsigned long *scull_pid_registered;
+static unsigned long *scull_pid_referenced;
+static DEFINE_PER_CPU(unsigned long, scull_filter_hits);
+static DEFINE_PER_CPU(unsigned long, scull_filter_misses);
+
+/*
+ * Per-CPU cache of the last nodes looked up, indexed by pid, so a task
+ * calling in repeatedly on the same core finds its entry without touching
+ * the XArray. Entries are only used under RCU; deleting a node clears it
+ * from every CPU's cache before the grace period starts.
+ */
+#define SCULL_LOOKUP_CACHE 8	/* power of 2 */
+
+struct scull_lookup_cache {
+	struct task_info_node *node[SCULL_LOOKUP_CACHE];
+	unsigned long hits;
+	unsigned long misses;
+};
+
+static DEFINE_PER_CPU(struct scull_lookup_cache, scull_lookup_cache);
+
+/*
+ * Nodes come from a SLAB_ACCOUNT cache so they are charged to the memcg of
+ * whoever allocates them: the ioctl caller. Follow mode takes nodes from a
+ * pool in atomic context; every node it spends is replaced by one charged
+ * to the memcg of the child it went to (scull_pool_refill_for), so a fork
+ * storm is paid for by its own tenant, not by the worker's root memcg.
+ * Per-cgroup counts are kept alongside, under task_info_node_mutex, for
+ * /sys/kernel/debug/scull/cgroups.
+ */
+static struct kmem_cache *scull_node_cache;
+
+struct scull_cgroup_count {
+	u64 cgid;
+	long nr_nodes;
+	struct hlist_node hash;
+};
+
+static DEFINE_HASHTABLE(scull_cgroup_counts, 6);
+
+static struct cdev scull_cdev;		/* Char device structure */
+
+/*
+ * Follow mode: a registered task with SCULL_NODE_FOLLOW set has its future
+ * children and threads registered for it. The sched_process_fork probe runs
+ * in atomic context, so it cannot allocate or take task_info_node_mutex:
+ * it takes a node from a preallocated pool, queues it on a lockless list and
+ * leaves the insert (and replacing the pool node) to scull_insert_work.
+ *
+ * The same lockless list carries deferred SCULL_IOCIQUANTUM registrations
+ * (scull_defer_insert): the ioctl queues the caller's node and returns, and
+ * the work item applies everything queued in one pass under the mutex.
+ */
+static LIST_HEAD(scull_node_pool);
+static DEFINE_SPINLOCK(scull_node_pool_lock);
+static int scull_node_pool_count;
+
+static LLIST_HEAD(scull_pending_nodes);
+static atomic_t scull_nr_followed = ATOMIC_INIT(0);
+static atomic_long_t scull_follow_dropped = ATOMIC_LONG_INIT(0);
+
+static atomic_long_t scull_deferred = ATOMIC_LONG_INIT(0);
+
+static void scull_insert_work_fn(struct work_struct *work);
+static DECLARE_WORK(scull_insert_work, scull_insert_work_fn);
+
+/* Called under rcu_read_lock() */
+static struct task_info_node *scull_lookup_rcu(pid_t pid, pid_t tgid)
+{
+	struct task_info_node *node;
+
+	node = scull_ops->lookup(pid);
+	if (node && node->tgid == tgid)
+		return node;
+	return NULL;
+}
+
+/*
+ * Called with task_info_node_mutex held. The node stays valid after
+ * rcu_read_unlock() because only mutex holders delete nodes. An exited
+ * entry is not the caller's: a single-threaded process reusing a dead
+ * one's pid has the same (pid, tgid), and scull_insert_node() replaces it.
+ */
+static struct task_info_node *scull_find_node(pid_t pid, pid_t tgid)
+{
+	struct task_info_node *node;
+
+	rcu_read_lock();
+	node = scull_lookup_rcu(pid, tgid);
+	rcu_read_unlock();
+	if (node && test_bit(SCULL_NODE_EXITED, &node->flags))
+		return NULL;
+	return node;
+}
+
+/* Called under rcu_read_lock() */
+static struct task_info_node *scull_cached_lookup(pid_t pid, pid_t tgid)
+{
+	struct task_info_node **slot, *node;
+	struct scull_lookup_cache *cache;
+
+	cache = get_cpu_ptr(&scull_lookup_cache);
+	slot = &cache->node[pid & (SCULL_LOOKUP_CACHE - 1)];
+	node = READ_ONCE(*slot);
+	if (node && node->pid == pid && node->tgid == tgid) {
+		if (static_branch_likely(&scull_stats_key))
+			cache->hits++;
+		goto out;
+	}
+	if (static_branch_likely(&scull_stats_key))
+		cache->misses++;
+	node = scull_lookup_rcu(pid, tgid);
+	if (node) {
+		WRITE_ONCE(*slot, node);
+		/*
+		 * Pairs with scull_uncache_node(): either it sees our store, or
+		 * we see the node gone from the XArray and take it back out.
+		 */
+		smp_mb();
+		if (scull_ops->lookup(pid) != node)
+			cmpxchg(slot, node, NULL);
+	}
+out:
+	put_cpu_ptr(cache);
+	return node;
+}
+
+/* Called after the node has been erased from the XArray */
+static void scull_uncache_node(struct task_info_node *node)
+{
+	struct scull_lookup_cache *cache;
+	int cpu;
+
+	smp_mb();
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(&scull_lookup_cache, cpu);
+		cmpxchg(&cache->node[node->pid & (SCULL_LOOKUP_CACHE - 1)], node, NULL);
+	}
+}
+
+static void scull_fill_info(struct task_info *info, struct task_struct *task)
+{
+	info->state = task->state;
+	info->cpu = task->cpu;
+	info->prio = task->prio;
+	info->pid = task->pid;
+	info->tgid = task->tgid;
+	info->nvcsw = task->nvcsw;
+	info->nivcsw = task->nivcsw;
+}
+
+/*
+ * Every insert, snapshot change and delete takes the next generation, so
+ * a reader holding generation G can ask for just what happened after it
+ * (SCULL_IOCSINCE). Deletes leave a tombstone in a bounded ring.
+ */
+static atomic64_t scull_generation = ATOMIC64_INIT(0);
+
+static void scull_node_set_info(struct task_info_node *node, const struct task_info *info)
+{
+	write_seqlock(&node->lock);
+	if (memcmp(&node->info, info, sizeof(*info))) {
+		node->info = *info;
+		node->gen = atomic64_inc_return(&scull_generation);
+	}
+	write_sequnlock(&node->lock);
+}
+
+static void scull_node_get_info(struct task_info_node *node, struct task_info *info)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&node->lock);
+		*info = node->info;
+	} while (read_seqretry(&node->lock, seq));
+}
+
+/* Mark a pid as recently used without dirtying its cache line every time */
+static inline void scull_touch_pid(pid_t pid)
+{
+	if (!test_bit(pid, scull_pid_referenced))
+		set_bit(pid, scull_pid_referenced);
+}
+
+static u64 scull_task_cgid(struct task_struct *task)
+{
+	u64 cgid = 0;
+
+#ifdef CONFIG_CGROUPS
+	rcu_read_lock();
+	cgid = cgroup_id(task_dfl_cgroup(task));
+	rcu_read_unlock();
+#endif
+	return cgid;
+}
+
+/* Called with task_info_node_mutex held */
+static void scull_cgroup_account(u64 cgid, long delta)
+{
+	struct scull_cgroup_count *cc;
+
+	hash_for_each_possible(scull_cgroup_counts, cc, hash, cgid) {
+		if (cc->cgid == cgid)
+			goto found;
+	}
+	if (delta < 0)
+		return;
+	cc = kzalloc(sizeof(*cc), GFP_KERNEL);
+	if (!cc)
+		return;
+	cc->cgid = cgid;
+	hash_add(scull_cgroup_counts, &cc->hash, cgid);
+found:
+	cc->nr_nodes += delta;
+	if (cc->nr_nodes <= 0) {
+		hash_del(&cc->hash);
+		kfree(cc);
+	}
+}
+
+static void scull_free_node_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(scull_node_cache, container_of(rcu, struct task_info_node, rcu));
+}
+
+static bool scull_task_alive(pid_t pid, pid_t tgid)
+{
+	struct task_struct *task;
+	bool alive = false;
+
+	rcu_read_lock();
+	task = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+	if (task && task->tgid == tgid && !(task->flags & PF_EXITING))
+		alive = true;
+	rcu_read_unlock();
+	return alive;
+}
+
+/*
+ * Tombstones: the last scull_tombstones deletes. scull_tomb_floor is the
+ * generation of the newest one overwritten; a reader behind it may have
+ * missed deletes and has to read everything again.
+ */
+struct scull_tomb {
+	pid_t pid;
+	pid_t tgid;
+	u64 gen;
+};
+
+static struct scull_tomb *scull_tombs;
+static unsigned long scull_tomb_head;	/* tombstones ever written */
+static u64 scull_tomb_floor;
+static DEFINE_SPINLOCK(scull_tomb_lock);
+
+static int scull_tombs_init(void)
+{
+	scull_tombstones = max(scull_tombstones, 1U);
+	scull_tombs = vzalloc(array_size(scull_tombstones, sizeof(*scull_tombs)));
+	return scull_tombs ? 0 : -ENOMEM;
+}
+
+static void scull_tombstone(struct task_info_node *node)
+{
+	struct scull_tomb *t;
+
+	spin_lock(&scull_tomb_lock);
+	t = &scull_tombs[scull_tomb_head++ % scull_tombstones];
+	if (t->gen)
+		scull_tomb_floor = t->gen;
+	t->pid = node->pid;
+	t->tgid = node->tgid;
+	t->gen = atomic64_inc_return(&scull_generation);
+	spin_unlock(&scull_tomb_lock);
+}
+
+/*
+ * The exit probe keeps scull_pid_registered exact across pid reuse, which
+ * only matters while the registry holds something. Attached before the
+ * first node's filter bit is set; detached from a work item once the last
+ * node is gone, since deletes also come from the shrinker.
+ */
+static bool scull_exit_attached;	/* under task_info_node_mutex */
+
+static void scull_registry_unlock(void);
+
+static void scull_exit_detach_fn(struct work_struct *work)
+{
+	mutex_lock(&task_info_node_mutex);
+	if (scull_exit_attached && !atomic_long_read(&scull_nr_nodes)) {
+		mutex_lock(&scull_tp_mutex);
+		scull_probes_put(BIT(SCULL_TPI_EXIT));
+		mutex_unlock(&scull_tp_mutex);
+		scull_exit_attached = false;
+	}
+	scull_registry_unlock();	/* combiners may be waiting on us */
+}
+
+static DECLARE_WORK(scull_exit_detach_work, scull_exit_detach_fn);
+
+/* Called with task_info_node_mutex held */
+static void scull_exit_attach(void)
+{
+	if (scull_exit_attached)
+		return;
+	mutex_lock(&scull_tp_mutex);
+	scull_exit_attached = !scull_probes_get(BIT(SCULL_TPI_EXIT));
+	mutex_unlock(&scull_tp_mutex);
+}
+
+/* Called with task_info_node_mutex held */
+static void scull_delete_node(struct task_info_node *node)
+{
+	scull_tombstone(node);
+	scull_ops->erase(node);
+	scull_uncache_node(node);
+	clear_bit(node->pid, scull_pid_registered);
+	clear_bit(node->pid, scull_pid_referenced);
+	scull_cgroup_account(node->cgid, -1);
+	if (atomic_long_dec_and_test(&scull_nr_nodes))
+		schedule_work(&scull_exit_detach_work);
+	if (test_bit(SCULL_NODE_FOLLOW, &node->flags))
+		atomic_dec(&scull_nr_followed);
+	call_rcu(&node->rcu, scull_free_node_rcu);
+}
+
+/*
+ * Called with task_info_node_mutex held, after scull_find_node() missed.
+ * An entry already at this pid belongs to a task that has exited (pids are
+ * unique among live tasks), so it is replaced. Frees node on failure.
+ */
+static int scull_insert_node(struct task_info_node *node)
+{
+	struct task_info_node *old;
+	int err;
+
+	rcu_read_lock();
+	old = scull_ops->lookup(node->pid);
+	rcu_read_unlock();
+	if (old)
+		scull_delete_node(old);
+	/*
+	 * Publish first, then stamp: a SCULL_IOCSINCE reader that has read a
+	 * generation at or past ours is then sure to find the node, and skips
+	 * it meanwhile as newer than anything it asked for.
+	 */
+	node->gen = U64_MAX;
+	err = scull_ops->insert(node);
+	if (err) {
+		clear_bit(node->pid, scull_pid_registered);
+		kmem_cache_free(scull_node_cache, node);
+		return err;
+	}
+	write_seqlock(&node->lock);
+	node->gen = atomic64_inc_return(&scull_generation);
+	write_sequnlock(&node->lock);
+	/*
+	 * Set the filter bit before checking for exit: either the exit probe
+	 * runs after us and clears it, or we see PF_EXITING here.
+	 */
+	scull_exit_attach();
+	set_bit(node->pid, scull_pid_registered);
+	if (!scull_task_alive(node->pid, node->tgid)) {
+		clear_bit(node->pid, scull_pid_registered);
+		set_bit(SCULL_NODE_EXITED, &node->flags);
+	}
+	scull_cgroup_account(node->cgid, 1);
+	atomic_long_inc(&scull_nr_nodes);
+	if (test_bit(SCULL_NODE_FOLLOW, &node->flags))
+		atomic_inc(&scull_nr_followed);
+	return 0;
+}
+
+static void scull_node_init(struct task_info_node *node, struct task_struct *task,
+			    unsigned long flags)
+{
+	node->pid = task->pid;
+	node->tgid = task->tgid;
+	node->flags = flags;
+	node->cgid = scull_task_cgid(task);
+	node->wake_ns = 0;
+	node->off_ns = 0;
+	node->watch_csw = task->nvcsw + task->nivcsw;
+	node->watch_since = jiffies;
+	node->sample_migr = task->se.nr_migrations;
+	node->sample_nivcsw = task->nivcsw;
+	seqlock_init(&node->lock);
+	scull_fill_info(&node->info, task);
+}
+
+static struct task_info_node *scull_alloc_node(struct task_struct *task)
+{
+	struct task_info_node *node;
+
+	node = kmem_cache_alloc(scull_node_cache, GFP_KERNEL);
+	if (node)
+		scull_node_init(node, task, 0);
+	return node;
+}
+
+/*
+ * Flat-combining insert. A task that needs a node inserted publishes a
+ * request on scull_insert_reqs and then either takes task_info_node_mutex
+ * itself or sleeps until some other holder has applied it. Every holder
+ * drains the published requests in scull_registry_unlock() before letting
+ * go, so a burst of N first-time callers costs about one lock hand-off.
+ */
+struct scull_insert_req {
+	struct llist_node llnode;
+	struct task_info_node *node;
+	int done;
+};
+
+static LLIST_HEAD(scull_insert_reqs);
+static DECLARE_WAIT_QUEUE_HEAD(scull_combine_wq);
+static atomic_long_t scull_combine_batches = ATOMIC_LONG_INIT(0);
+static atomic_long_t scull_combined = ATOMIC_LONG_INIT(0);
+
+/* Called with task_info_node_mutex held */
+static void scull_combine_inserts(void)
+{
+	struct scull_insert_req *req, *tmp;
+	struct task_info_node *found;
+	struct llist_node *batch;
+	long n = 0;
+
+	batch = llist_del_all(&scull_insert_reqs);
+	if (!batch)
+		return;
+
+	/* req lives on its publisher's stack: done must be the last access */
+	llist_for_each_entry_safe(req, tmp, batch, llnode) {
+		found = scull_find_node(req->node->pid, req->node->tgid);
+		if (found) {
+			scull_touch_pid(found->pid);
+			kmem_cache_free(scull_node_cache, req->node);
+		} else {
+			scull_insert_node(req->node);
+		}
+		smp_store_release(&req->done, 1);
+		n++;
+	}
+	atomic_long_inc(&scull_combine_batches);
+	atomic_long_add(n, &scull_combined);
+}
+
+static void scull_registry_unlock(void)
+{
+	scull_combine_inserts();
+	mutex_unlock(&task_info_node_mutex);
+	if (wq_has_sleeper(&scull_combine_wq))
+		wake_up_all(&scull_combine_wq);
+}
+
+/* Insert node (or drop it if the task is already there); may sleep */
+static void scull_registry_insert(struct task_info_node *node)
+{
+	struct scull_insert_req req = { .node = node, .done = 0 };
+	bool locked = false;
+
+	llist_add(&req.llnode, &scull_insert_reqs);
+	/*
+	 * done may be set between the two tests; what matters is whether the
+	 * trylock won, since then the lock is ours whatever done says.
+	 */
+	wait_event(scull_combine_wq, smp_load_acquire(&req.done) ||
+				     (locked = mutex_trylock(&task_info_node_mutex)));
+	if (locked)
+		scull_registry_unlock();	/* we hold the lock: combine */
+}
+
+static void scull_pool_refill(void)
+{
+	struct task_info_node *node;
+
+	while (READ_ONCE(scull_node_pool_count) < scull_follow_prealloc) {
+		node = kmem_cache_alloc(scull_node_cache, GFP_KERNEL);
+		if (!node)
+			break;
+		spin_lock(&scull_node_pool_lock);
+		list_add(&node->list, &scull_node_pool);
+		scull_node_pool_count++;
+		spin_unlock(&scull_node_pool_lock);
+	}
+}
+
+/* The memcg of pid's mm, with a reference; NULL if it is gone */
+static struct mem_cgroup *scull_task_memcg(pid_t pid)
+{
+	struct mem_cgroup *memcg = NULL;
+	struct task_struct *task;
+	struct mm_struct *mm;
+
+	rcu_read_lock();
+	task = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+	if (task)
+		get_task_struct(task);
+	rcu_read_unlock();
+	if (!task)
+		return NULL;
+
+	mm = get_task_mm(task);
+	if (mm) {
+		memcg = get_mem_cgroup_from_mm(mm);
+		mmput(mm);
+	}
+	put_task_struct(task);
+	return memcg;
+}
+
+/*
+ * Replace the pool node spent on pid with one charged to pid's memcg (or
+ * its thread group's, if pid is already gone). When neither is left the
+ * pool stays one short until the follower's next SCULL_IOCTFOLLOW.
+ */
+static void scull_pool_refill_for(pid_t pid, pid_t tgid)
+{
+	struct mem_cgroup *memcg, *old;
+	struct task_info_node *node;
+
+	if (READ_ONCE(scull_node_pool_count) >= scull_follow_prealloc)
+		return;
+	memcg = scull_task_memcg(pid);
+	if (!memcg && tgid != pid)
+		memcg = scull_task_memcg(tgid);
+	if (!memcg)
+		return;
+
+	old = set_active_memcg(memcg);
+	node = kmem_cache_alloc(scull_node_cache, GFP_KERNEL);
+	set_active_memcg(old);
+	mem_cgroup_put(memcg);
+	if (!node)
+		return;
+
+	spin_lock(&scull_node_pool_lock);
+	list_add(&node->list, &scull_node_pool);
+	scull_node_pool_count++;
+	spin_unlock(&scull_node_pool_lock);
+}
+
+static struct task_info_node *scull_pool_get(void)
+{
+	struct task_info_node *node = NULL;
+
+	spin_lock(&scull_node_pool_lock);
+	if (!list_empty(&scull_node_pool)) {
+		node = list_first_entry(&scull_node_pool, struct task_info_node, list);
+		list_del(&node->list);
+		scull_node_pool_count--;
+	}
+	spin_unlock(&scull_node_pool_lock);
+	return node;
+}
+
+/* Queue a node for scull_insert_work; safe from atomic context */
+static void scull_defer_node(struct task_info_node *node)
+{
+	llist_add(&node->pending, &scull_pending_nodes);
+	schedule_work(&scull_insert_work);
+}
+
+static bool scull_task_followed(struct task_struct *task)
+{
+	struct task_info_node *node;
+	bool followed = false;
+
+	rcu_read_lock();
+	node = scull_lookup_rcu(task->pid, task->tgid);
+	if (node && test_bit(SCULL_NODE_FOLLOW, &node->flags)) {
+		scull_touch_pid(node->pid);
+		followed = true;
+	}
+	rcu_read_unlock();
+	return followed;
+}
+
+/*
+ * A child forked by a followed task before the worker has inserted the
+ * parent's own node is not seen as followed; the window is one work item.
+ */
+static void scull_fork_probe(void *data, struct task_struct *parent,
+			     struct task_struct *child)
+{
+	struct task_info_node *node;
+
+	if (!static_branch_likely(&scull_follow_key))
+		return;
+	if (!atomic_read(&scull_nr_followed))
+		return;
+	if (!scull_task_followed(parent))
+		return;
+
+	node = scull_pool_get();
+	if (!node) {
+		/* Refilled as followed children are inserted, or by SCULL_IOCTFOLLOW */
+		atomic_long_inc(&scull_follow_dropped);
+		return;
+	}
+	scull_node_init(node, child, BIT(SCULL_NODE_FOLLOW) | BIT(SCULL_NODE_POOL));
+	set_bit(node->pid, scull_pid_registered);
+	scull_defer_node(node);
+}
+
+/*
+ * Keep the filter exact across pid reuse: once a task exits its pid no
+ * longer answers for it. The entry itself stays (with its last snapshot)
+ * until the shrinker takes it, which can then skip the pid lookup.
+ */
+static void scull_exit_probe(void *data, struct task_struct *task)
+{
+	struct task_info_node *node;
+
+	if (!test_bit(task->pid, scull_pid_registered))
+		return;
+	clear_bit(task->pid, scull_pid_registered);
+
+	rcu_read_lock();
+	node = scull_lookup_rcu(task->pid, task->tgid);
+	if (node)
+		set_bit(SCULL_NODE_EXITED, &node->flags);
+	rcu_read_unlock();
+}
+
+static void scull_insert_work_fn(struct work_struct *work)
+{
+	struct task_info_node *node, *tmp, *found;
+	struct llist_node *batch;
+
+	batch = llist_reverse_order(llist_del_all(&scull_pending_nodes));
+
+	/* Nodes from the fork probe came out of the pool: put one back */
+	llist_for_each_entry(node, batch, pending)
+		if (test_and_clear_bit(SCULL_NODE_POOL, &node->flags))
+			scull_pool_refill_for(node->pid, node->tgid);
+
+	mutex_lock(&task_info_node_mutex);
+	llist_for_each_entry_safe(node, tmp, batch, pending) {
+		/* A task may have queued itself more than once meanwhile */
+		found = scull_find_node(node->pid, node->tgid);
+		if (found) {
+			if (test_bit(SCULL_NODE_FOLLOW, &node->flags) &&
+			    !test_and_set_bit(SCULL_NODE_FOLLOW, &found->flags))
+				atomic_inc(&scull_nr_followed);
+			kmem_cache_free(scull_node_cache, node);
+			continue;
+		}
+		scull_insert_node(node);
+	}
+	scull_registry_unlock();
+}
+
+/*
+ * Shrinker: the registry is only a record of who asked, so under memory
+ * pressure entries can go. Entries of exited tasks are dropped first; live
+ * ones get a second chance (CLOCK) through scull_pid_referenced, set on
+ * every lookup and cleared here. Followed live tasks are never reclaimed,
+ * since their node is what makes the fork probe enroll their children.
+ */
+static unsigned long scull_shrink_count(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	long count;
+
+	count = atomic_long_read(&scull_nr_nodes) - atomic_read(&scull_nr_followed);
+	return count > 0 ? count : SHRINK_EMPTY;
+}
+
+/*
+ * Clock hand: the pid the next scan resumes from (task_info_node_mutex).
+ * Only ordered backends can resume; the others start over each time.
+ */
+static pid_t scull_shrink_cursor;
+
+struct scull_shrink_ctl {
+	unsigned long nr_to_scan;
+	unsigned long scanned;
+	unsigned long freed;
+	pid_t stop;		/* the wrapped-around pass ends here */
+	pid_t last;
+};
+
+static bool scull_shrink_one(struct task_info_node *node, void *arg)
+{
+	struct scull_shrink_ctl *ctl = arg;
+
+	if (ctl->scanned >= ctl->nr_to_scan || node->pid >= ctl->stop)
+		return false;
+	ctl->scanned++;
+	ctl->last = node->pid;
+	if (!test_bit(SCULL_NODE_EXITED, &node->flags) &&
+	    scull_task_alive(node->pid, node->tgid)) {
+		if (test_bit(SCULL_NODE_FOLLOW, &node->flags))
+			return true;
+		if (test_and_clear_bit(node->pid, scull_pid_referenced))
+			return true;
+	}
+	scull_delete_node(node);	/* freed after the grace period */
+	ctl->freed++;
+	return true;
+}
+
+static unsigned long scull_shrink_scan(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct scull_shrink_ctl ctl = {
+		.nr_to_scan = sc->nr_to_scan,
+		.stop = PID_MAX_LIMIT,
+	};
+	pid_t start;
+
+	if (!mutex_trylock(&task_info_node_mutex))
+		return SHRINK_STOP;
+
+	start = scull_ops->ordered ? scull_shrink_cursor : 0;
+	rcu_read_lock();
+	scull_ops->walk(start, scull_shrink_one, &ctl);
+	if (start && ctl.scanned < ctl.nr_to_scan) {
+		ctl.stop = start;
+		scull_ops->walk(0, scull_shrink_one, &ctl);
+	}
+	rcu_read_unlock();
+	scull_shrink_cursor = ctl.scanned ? ctl.last + 1 : 0;
+	/* No combining here: inserts may allocate, and we are in reclaim */
+	mutex_unlock(&task_info_node_mutex);
+	if (wq_has_sleeper(&scull_combine_wq))
+		wake_up_all(&scull_combine_wq);
+
+	return ctl.freed;
+}
+
+static struct shrinker scull_shrinker = {
+	.count_objects = scull_shrink_count,
+	.scan_objects  = scull_shrink_scan,
+	.seeks         = DEFAULT_SEEKS,
+};
+
+/*
+ * sched_switch: everything that has to be seen at context switch time.
+ * Each consumer is a separate feature, so with all of them off the probe
+ * is a handful of patched-out branches.
+ *
+ * cpustat keeps, per CPU, the pid now running there and a count of
+ * switches since the feature was enabled (the runqueue's own counter is
+ * private to the scheduler).
+ */
+struct scull_cpu_stat {
+	pid_t curr;
+	unsigned long nr_switches;
+};
+
+static DEFINE_PER_CPU(struct scull_cpu_stat, scull_cpu_stat);
+
+/*
+ * history keeps, per CPU, a ring of the last scull_switch_history
+ * (pid, switch-in, switch-out) records of registered tasks, mapped
+ * read-only to user space at SCULL_MMAP_SWITCH_OFF: one page-aligned
+ * struct scull_switch_ring per possible CPU, in CPU order. Only the CPU
+ * itself writes its ring, with the rq lock held, so publishing a record
+ * is a store-release of head.
+ */
+static void *scull_switch_rings;
+static size_t scull_switch_ring_size;	/* bytes per CPU, page aligned */
+
+struct scull_switch_in {
+	pid_t pid;		/* registered task running here, 0 if none */
+	u64 in_ns;
+};
+
+static DEFINE_PER_CPU(struct scull_switch_in, scull_switch_in);
+
+static struct scull_switch_ring *scull_cpu_switch_ring(int cpu)
+{
+	return scull_switch_rings + cpu * scull_switch_ring_size;
+}
+
+static int scull_switch_rings_init(void)
+{
+	int cpu;
+
+	if (!scull_switch_history)
+		scull_switch_history = 1;
+	scull_switch_ring_size = PAGE_ALIGN(struct_size((struct scull_switch_ring *)NULL,
+							recs, scull_switch_history));
+	scull_switch_rings = vmalloc_user(nr_cpu_ids * scull_switch_ring_size);
+	if (!scull_switch_rings)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		scull_cpu_switch_ring(cpu)->nr = scull_switch_history;
+		scull_cpu_switch_ring(cpu)->cpu = cpu;
+	}
+	return 0;
+}
+
+static void scull_history_switch(struct task_struct *prev, struct task_struct *next)
+{
+	struct scull_switch_in *in = this_cpu_ptr(&scull_switch_in);
+	struct scull_switch_ring *ring;
+	struct scull_switch_rec *rec;
+	u64 now = ktime_get_mono_fast_ns();
+	unsigned long long head;
+
+	if (in->pid && in->pid == prev->pid) {
+		ring = scull_cpu_switch_ring(smp_processor_id());
+		head = ring->head;
+		rec = &ring->recs[head % ring->nr];
+		rec->pid = prev->pid;
+		rec->in_ns = in->in_ns;
+		rec->out_ns = now;
+		smp_store_release(&ring->head, head + 1);
+	}
+	if (test_bit(next->pid, scull_pid_registered)) {
+		in->pid = next->pid;
+		in->in_ns = now;
+	} else {
+		in->pid = 0;
+	}
+}
+
+/*
+ * wakeup aggregates, for every registered task woken by another registered
+ * task, one waker->wakee edge: how often, and the summed time from
+ * sched_waking to the wakee actually running. The waking side only stamps
+ * the wakee's node; the edge is accounted when the wakee switches in.
+ * Edges live in a fixed open-addressed table of scull_wake_edges slots
+ * allocated at load, so the probes never allocate; once it is full new
+ * edges are counted in scull_wake_dropped and lost, until it is emptied by
+ * a SCULL_TABLE_CLEAR read or by turning the feature back on.
+ */
+struct scull_wake_slot {
+	pid_t waker;		/* 0: slot unused */
+	pid_t wakee;
+	unsigned long count;
+	u64 lat_ns;
+};
+
+static struct scull_wake_slot *scull_wake_table;
+static unsigned int scull_wake_used;
+static atomic_long_t scull_wake_dropped = ATOMIC_LONG_INIT(0);
+static DEFINE_RAW_SPINLOCK(scull_wake_lock);
+
+static int scull_wake_table_init(void)
+{
+	scull_wake_edges = roundup_pow_of_two(max(scull_wake_edges, 2U));
+	scull_wake_table = vzalloc(array_size(scull_wake_edges, sizeof(*scull_wake_table)));
+	return scull_wake_table ? 0 : -ENOMEM;
+}
+
+/* Called with scull_wake_lock held */
+static void scull_wake_clear(void)
+{
+	memset(scull_wake_table, 0, array_size(scull_wake_edges, sizeof(*scull_wake_table)));
+	scull_wake_used = 0;
+	atomic_long_set(&scull_wake_dropped, 0);
+}
+
+/* Also called for a load-time setting, before the table exists */
+static void scull_wake_reset(void)
+{
+	if (!scull_wake_table)
+		return;
+	raw_spin_lock_irq(&scull_wake_lock);
+	scull_wake_clear();
+	raw_spin_unlock_irq(&scull_wake_lock);
+}
+
+static void scull_wake_account(pid_t waker, pid_t wakee, u64 lat_ns)
+{
+	struct scull_wake_slot *slot;
+	unsigned int i, mask = scull_wake_edges - 1;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&scull_wake_lock, flags);
+	for (i = hash_32(waker ^ (wakee << 16), 32) & mask; ; i = (i + 1) & mask) {
+		slot = &scull_wake_table[i];
+		if (slot->waker == waker && slot->wakee == wakee)
+			break;
+		if (!slot->waker) {
+			/* keep one slot free so the probe loop ends */
+			if (scull_wake_used + 1 >= scull_wake_edges) {
+				atomic_long_inc(&scull_wake_dropped);
+				goto out;
+			}
+			scull_wake_used++;
+			slot->waker = waker;
+			slot->wakee = wakee;
+			break;
+		}
+	}
+	slot->count++;
+	slot->lat_ns += lat_ns;
+out:
+	raw_spin_unlock_irqrestore(&scull_wake_lock, flags);
+}
+
+static void scull_waking_probe(void *data, struct task_struct *p)
+{
+	struct task_info_node *node;
+
+	if (!static_branch_unlikely(&scull_wakeup_key))
+		return;
+	if (!in_task() || !test_bit(p->pid, scull_pid_registered) ||
+	    !test_bit(current->pid, scull_pid_registered))
+		return;
+
+	rcu_read_lock();
+	node = scull_lookup_rcu(p->pid, p->tgid);
+	if (node) {
+		WRITE_ONCE(node->waker, current->pid);
+		WRITE_ONCE(node->wake_ns, ktime_get_mono_fast_ns());
+	}
+	rcu_read_unlock();
+}
+
+static void scull_wakeup_switch(struct task_struct *next)
+{
+	struct task_info_node *node;
+	u64 wake_ns;
+
+	if (!test_bit(next->pid, scull_pid_registered))
+		return;
+
+	rcu_read_lock();
+	node = scull_lookup_rcu(next->pid, next->tgid);
+	wake_ns = node ? xchg(&node->wake_ns, 0) : 0;
+	if (wake_ns)
+		scull_wake_account(READ_ONCE(node->waker), next->pid,
+				   ktime_get_mono_fast_ns() - wake_ns);
+	rcu_read_unlock();
+}
+
+static int scull_read_wakes(struct scull_wakes *wakes)
+{
+	struct scull_wake_edge *buf;
+	struct scull_wake_slot *slot;
+	unsigned int i, max, n = 0;
+	int retval = 0;
+
+	if (wakes->flags & ~SCULL_TABLE_CLEAR)
+		return -EINVAL;
+	/* The table is shared by every reader */
+	if ((wakes->flags & SCULL_TABLE_CLEAR) && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	max = min_t(unsigned int, wakes->count, scull_wake_edges);
+	buf = kvmalloc_array(max ? max : 1, sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	raw_spin_lock_irq(&scull_wake_lock);
+	for (i = 0; i < scull_wake_edges && n < max; i++) {
+		slot = &scull_wake_table[i];
+		if (!slot->waker)
+			continue;
+		buf[n].waker = slot->waker;
+		buf[n].wakee = slot->wakee;
+		buf[n].count = slot->count;
+		buf[n].lat_ns = slot->lat_ns;
+		n++;
+	}
+	wakes->total = scull_wake_used;
+	wakes->dropped = atomic_long_read(&scull_wake_dropped);
+	if (wakes->flags & SCULL_TABLE_CLEAR)
+		scull_wake_clear();
+	raw_spin_unlock_irq(&scull_wake_lock);
+
+	if (copy_to_user((void __user *)wakes->entries, buf, n * sizeof(*buf)))
+		retval = -EFAULT;
+	wakes->count = n;
+	kvfree(buf);
+	return retval;
+}
+
+/*
+ * offcpu: when a registered task blocks (switches out not runnable), save
+ * its kernel stack and stamp the node; when it next switches in, add the
+ * time it was away to its (pid, stack) slot. Same fixed open-addressed
+ * table as the wakeup graph.
+ *
+ * Stacks are kept once each in a second such table, keyed by a hash of
+ * their ips, with as many slots; a stack's handle is its index + 1. The
+ * stack depot will not do here: on the kernels this targets it may
+ * allocate pages whatever the gfp mask, and the page allocator can wake
+ * kswapd, which takes an rq lock, while we hold one. A stack that finds
+ * the table full is accounted under handle 0.
+ *
+ * Neither table frees single slots; both are emptied together by a
+ * SCULL_TABLE_CLEAR read or by turning the feature back on. Handles carry
+ * the low bits of the table generation in their top byte, so a task that
+ * blocked before a clear is accounted under handle 0, not under whatever
+ * stack took its slot since.
+ */
+#define SCULL_STACK_IDX_BITS	24
+#define SCULL_STACK_IDX_MASK	((1U << SCULL_STACK_IDX_BITS) - 1)
+struct scull_offcpu_slot {
+	pid_t pid;		/* 0: slot unused */
+	u32 stack;
+	unsigned long count;
+	u64 off_ns;
+};
+
+struct scull_stack_slot {
+	u32 hash;		/* 0: slot unused */
+	u32 nr;
+	unsigned long ips[SCULL_STACK_MAX];
+};
+
+static struct scull_offcpu_slot *scull_offcpu_table;
+static unsigned int scull_offcpu_used;
+static struct scull_stack_slot *scull_stack_table;
+static unsigned int scull_stack_used;
+static u32 scull_stack_gen;
+static atomic_long_t scull_offcpu_dropped = ATOMIC_LONG_INIT(0);
+static DEFINE_RAW_SPINLOCK(scull_offcpu_lock);	/* both tables */
+
+static int scull_offcpu_table_init(void)
+{
+	scull_offcpu_slots = roundup_pow_of_two(clamp(scull_offcpu_slots, 2U,
+						      SCULL_STACK_IDX_MASK / 2 + 1));
+	scull_offcpu_table = vzalloc(array_size(scull_offcpu_slots, sizeof(*scull_offcpu_table)));
+	scull_stack_table = vzalloc(array_size(scull_offcpu_slots, sizeof(*scull_stack_table)));
+	return scull_offcpu_table && scull_stack_table ? 0 : -ENOMEM;
+}
+
+/* Never allocates: safe under the rq lock */
+static u32 scull_stack_save(const unsigned long *entries, unsigned int nr)
+{
+	struct scull_stack_slot *slot;
+	unsigned int i, mask = scull_offcpu_slots - 1;
+	u32 hash = jhash(entries, nr * sizeof(*entries), nr) ?: 1;
+	unsigned long flags;
+	u32 handle = 0;
+	u32 gen;
+
+	raw_spin_lock_irqsave(&scull_offcpu_lock, flags);
+	gen = (scull_stack_gen & 0xff) << SCULL_STACK_IDX_BITS;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		slot = &scull_stack_table[i];
+		if (slot->hash == hash && slot->nr == nr &&
+		    !memcmp(slot->ips, entries, nr * sizeof(*entries))) {
+			handle = gen | (i + 1);
+			break;
+		}
+		if (!slot->hash) {
+			if (scull_stack_used + 1 >= scull_offcpu_slots)
+				break;
+			scull_stack_used++;
+			slot->hash = hash;
+			slot->nr = nr;
+			memcpy(slot->ips, entries, nr * sizeof(*entries));
+			handle = gen | (i + 1);
+			break;
+		}
+	}
+	raw_spin_unlock_irqrestore(&scull_offcpu_lock, flags);
+	return handle;
+}
+
+/* Called with scull_offcpu_lock held: the slot behind a current handle */
+static struct scull_stack_slot *scull_stack_get(u32 handle)
+{
+	if (!handle || handle >> SCULL_STACK_IDX_BITS != (scull_stack_gen & 0xff))
+		return NULL;
+	return &scull_stack_table[(handle & SCULL_STACK_IDX_MASK) - 1];
+}
+
+/* Called with scull_offcpu_lock held */
+static void scull_offcpu_clear(void)
+{
+	memset(scull_offcpu_table, 0, array_size(scull_offcpu_slots, sizeof(*scull_offcpu_table)));
+	memset(scull_stack_table, 0, array_size(scull_offcpu_slots, sizeof(*scull_stack_table)));
+	scull_offcpu_used = 0;
+	scull_stack_used = 0;
+	scull_stack_gen++;
+	atomic_long_set(&scull_offcpu_dropped, 0);
+}
+
+/* Also called for a load-time setting, before the tables exist */
+static void scull_offcpu_reset(void)
+{
+	if (!scull_offcpu_table)
+		return;
+	raw_spin_lock_irq(&scull_offcpu_lock);
+	scull_offcpu_clear();
+	raw_spin_unlock_irq(&scull_offcpu_lock);
+}
+
+static void scull_offcpu_account(pid_t pid, u32 stack, u64 off_ns)
+{
+	struct scull_offcpu_slot *slot;
+	unsigned int i, mask = scull_offcpu_slots - 1;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&scull_offcpu_lock, flags);
+	if (!scull_stack_get(stack))
+		stack = 0;	/* saved before a clear */
+	for (i = hash_32(pid ^ stack, 32) & mask; ; i = (i + 1) & mask) {
+		slot = &scull_offcpu_table[i];
+		if (slot->pid == pid && slot->stack == stack)
+			break;
+		if (!slot->pid) {
+			if (scull_offcpu_used + 1 >= scull_offcpu_slots) {
+				atomic_long_inc(&scull_offcpu_dropped);
+				goto out;
+			}
+			scull_offcpu_used++;
+			slot->pid = pid;
+			slot->stack = stack;
+			break;
+		}
+	}
+	slot->count++;
+	slot->off_ns += off_ns;
+out:
+	raw_spin_unlock_irqrestore(&scull_offcpu_lock, flags);
+}
+
+static void scull_offcpu_switch(bool preempt, struct task_struct *prev,
+				struct task_struct *next)
+{
+	unsigned long entries[SCULL_STACK_MAX];
+	struct task_info_node *node;
+	unsigned int nr;
+	u64 now = ktime_get_mono_fast_ns();
+
+	rcu_read_lock();
+	if (!preempt && READ_ONCE(prev->state) != TASK_RUNNING &&
+	    test_bit(prev->pid, scull_pid_registered)) {
+		node = scull_lookup_rcu(prev->pid, prev->tgid);
+		if (node) {
+			/* prev is current: skip the probe and tracepoint frames */
+			nr = stack_trace_save(entries, ARRAY_SIZE(entries), 2);
+			node->off_stack = scull_stack_save(entries, nr);
+			WRITE_ONCE(node->off_ns, now);
+		}
+	}
+	if (test_bit(next->pid, scull_pid_registered)) {
+		node = scull_lookup_rcu(next->pid, next->tgid);
+		if (node && node->off_ns) {
+			scull_offcpu_account(next->pid, node->off_stack, now - node->off_ns);
+			WRITE_ONCE(node->off_ns, 0);
+		}
+	}
+	rcu_read_unlock();
+}
+
+/* Called with scull_offcpu_lock held: swap rec's handle for its stack */
+static void scull_offcpu_expand(struct scull_offcpu_stack *rec)
+{
+	struct scull_stack_slot *stack = scull_stack_get(rec->nr);
+
+	rec->nr = stack ? stack->nr : 0;
+	if (stack)
+		memcpy(rec->ips, stack->ips, stack->nr * sizeof(stack->ips[0]));
+}
+
+static int scull_read_offcpu(struct scull_offcpu *off)
+{
+	struct scull_offcpu_stack *buf;
+	struct scull_offcpu_slot *slot;
+	bool clear = off->flags & SCULL_TABLE_CLEAR;
+	unsigned int i, max, n = 0;
+	int retval = 0;
+
+	if (off->flags & ~SCULL_TABLE_CLEAR)
+		return -EINVAL;
+	if (clear && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	max = min_t(unsigned int, off->count, scull_offcpu_slots);
+	/* Zeroed: ips[] past each stack's nr is copied out as well */
+	buf = kvcalloc(max ? max : 1, sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	raw_spin_lock_irq(&scull_offcpu_lock);
+	for (i = 0; i < scull_offcpu_slots && n < max; i++) {
+		slot = &scull_offcpu_table[i];
+		if (!slot->pid)
+			continue;
+		buf[n].pid = slot->pid;
+		buf[n].nr = slot->stack;	/* handle, expanded below */
+		buf[n].count = slot->count;
+		buf[n].off_ns = slot->off_ns;
+		/* Clearing drops the stacks, so they are taken now */
+		if (clear)
+			scull_offcpu_expand(&buf[n]);
+		n++;
+	}
+	off->total = scull_offcpu_used;
+	off->dropped = atomic_long_read(&scull_offcpu_dropped);
+	if (clear)
+		scull_offcpu_clear();
+	raw_spin_unlock_irq(&scull_offcpu_lock);
+
+	/* One stack at a time, so irqs are not off for the whole copy */
+	for (i = 0; i < n && !clear; i++) {
+		if (!buf[i].nr)
+			continue;
+		raw_spin_lock_irq(&scull_offcpu_lock);
+		scull_offcpu_expand(&buf[i]);
+		raw_spin_unlock_irq(&scull_offcpu_lock);
+	}
+
+	if (copy_to_user((void __user *)off->entries, buf, n * sizeof(*buf)))
+		retval = -EFAULT;
+	off->count = n;
+	kvfree(buf);
+	return retval;
+}
+
+static void scull_switch_probe(void *data, bool preempt,
+			       struct task_struct *prev, struct task_struct *next)
+{
+	if (static_branch_likely(&scull_cpustat_key)) {
+		struct scull_cpu_stat *cs = this_cpu_ptr(&scull_cpu_stat);
+
+		WRITE_ONCE(cs->curr, next->pid);
+		WRITE_ONCE(cs->nr_switches, cs->nr_switches + 1);
+	}
+	if (static_branch_unlikely(&scull_history_key))
+		scull_history_switch(prev, next);
+	if (static_branch_unlikely(&scull_wakeup_key))
+		scull_wakeup_switch(next);
+	if (static_branch_unlikely(&scull_offcpu_key))
+		scull_offcpu_switch(preempt, prev, next);
+}
+
+/*
+ * The sched tracepoints are not exported to modules, so find them by name.
+ * Each probe is attached while it has users (the features that need it,
+ * and for the exit probe a non-empty registry) and detached after the last
+ * one goes, all under scull_tp_mutex.
+ */
+struct scull_tracepoint {
+	const char *name;
+	void *probe;
+	struct tracepoint *tp;
+	int users;
+};
+
+static struct scull_tracepoint scull_tracepoints[] = {
+	[SCULL_TPI_FORK]   = { .name = "sched_process_fork", .probe = scull_fork_probe },
+	[SCULL_TPI_EXIT]   = { .name = "sched_process_exit", .probe = scull_exit_probe },
+	[SCULL_TPI_SWITCH] = { .name = "sched_switch",       .probe = scull_switch_probe },
+	[SCULL_TPI_WAKING] = { .name = "sched_waking",       .probe = scull_waking_probe },
+};
+
+static bool scull_tp_ready;	/* looked up, and not torn down yet */
+
+static void scull_lookup_tracepoint(struct tracepoint *tp, void *priv)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(scull_tracepoints); i++) {
+		if (!strcmp(tp->name, scull_tracepoints[i].name))
+			scull_tracepoints[i].tp = tp;
+	}
+}
+
+static void scull_find_tracepoints(void)
+{
+	int i;
+
+	for_each_kernel_tracepoint(scull_lookup_tracepoint, NULL);
+	for (i = 0; i < ARRAY_SIZE(scull_tracepoints); i++) {
+		if (!scull_tracepoints[i].tp)
+			printk(KERN_WARNING "scull: tracepoint %s not found\n",
+			       scull_tracepoints[i].name);
+	}
+	mutex_lock(&scull_tp_mutex);
+	scull_tp_ready = true;
+	mutex_unlock(&scull_tp_mutex);
+}
+
+/* Called with scull_tp_mutex held */
+static int scull_tp_get(struct scull_tracepoint *stp)
+{
+	int ret;
+
+	if (stp->users++)
+		return 0;
+	ret = stp->tp ? tracepoint_probe_register(stp->tp, stp->probe, NULL) : -EOPNOTSUPP;
+	if (ret) {
+		printk(KERN_WARNING "scull: can't attach to %s\n", stp->name);
+		stp->users--;
+	}
+	return ret;
+}
+
+/* Called with scull_tp_mutex held */
+static void scull_tp_put(struct scull_tracepoint *stp)
+{
+	if (!--stp->users)
+		tracepoint_probe_unregister(stp->tp, stp->probe, NULL);
+}
+
+/* Called with scull_tp_mutex held; before the lookup there is nothing to do */
+static int scull_probes_get(unsigned int probes)
+{
+	int i, ret = 0;
+
+	if (!scull_tp_ready)
+		return 0;
+	for (i = 0; i < ARRAY_SIZE(scull_tracepoints); i++) {
+		if (!(probes & BIT(i)))
+			continue;
+		ret = scull_tp_get(&scull_tracepoints[i]);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		while (i--) {
+			if (probes & BIT(i))
+				scull_tp_put(&scull_tracepoints[i]);
+		}
+	}
+	return ret;
+}
+
+/* Called with scull_tp_mutex held */
+static void scull_probes_put(unsigned int probes)
+{
+	int i;
+
+	if (!scull_tp_ready)
+		return;
+	for (i = 0; i < ARRAY_SIZE(scull_tracepoints); i++) {
+		if (probes & BIT(i))
+			scull_tp_put(&scull_tracepoints[i]);
+	}
+}
+
+static void scull_unregister_tracepoints(void)
+{
+	struct scull_tracepoint *stp;
+	int i;
+
+	mutex_lock(&scull_tp_mutex);
+	scull_tp_ready = false;
+	for (i = 0; i < ARRAY_SIZE(scull_tracepoints); i++) {
+		stp = &scull_tracepoints[i];
+		if (stp->users)
+			tracepoint_probe_unregister(stp->tp, stp->probe, NULL);
+		stp->users = 0;
+	}
+	mutex_unlock(&scull_tp_mutex);
+	tracepoint_synchronize_unregister();
+}
+
+/* A subscription set (SCULL_IOCSUB); see scull_subscribed() */
+struct scull_subs {
+	struct xarray pids;
+	struct xarray tgids;
+	unsigned long count;	/* 0: subscribed to everything */
+	unsigned long stamp;	/* tags the entries of the update under way */
+};
+
+/*
+ * Per-open state, hung off filp->private_data.
+ *
+ * Snapshot ioctls are rate limited per open file with a token bucket kept
+ * as a GCRA "theoretical arrival time": a call is allowed as long as it is
+ * no more than burst - 1 intervals ahead of schedule.
+ */
+struct scull_file {
+	spinlock_t rate_lock;
+	unsigned int rate;		/* calls per second, 0 = unlimited */
+	unsigned int burst;
+	u64 tat;			/* ns */
+	unsigned long throttled;
+	struct mutex read_lock;		/* read state below */
+	unsigned int read_mode;		/* SCULL_READ_* */
+	pid_t read_cursor;		/* next pid of the pass under way */
+	bool read_eof;			/* pass ended, next read returns 0 */
+	struct xarray read_seen;	/* pid -> hash of the last record sent */
+	struct scull_zprev *zprev;	/* last SCULL_IOCZEXPORT, by pid */
+	unsigned long zprev_n;
+	unsigned int zprev_source;
+	struct list_head ring_list;	/* on scull_ring_consumers if attached */
+	unsigned int ring_policy;	/* SCULL_RING_* */
+	u64 ring_tail;			/* next sample ring record to read */
+	u64 ring_lost;			/* records lapped by the producer */
+	u64 ring_dropped;		/* header's dropped when attached */
+	struct scull_subs subs;		/* changed under read_lock */
+};
+
+static atomic_long_t scull_throttled = ATOMIC_LONG_INIT(0);
+
+static void scull_rate_set(struct scull_file *sf, unsigned int rate, unsigned int burst)
+{
+	spin_lock(&sf->rate_lock);
+	sf->rate = rate;
+	sf->burst = burst ? burst : 1;
+	sf->tat = 0;
+	spin_unlock(&sf->rate_lock);
+}
+
+/* Returns 0 if the call may proceed, else the ns to wait for a token */
+static u64 scull_rate_take(struct scull_file *sf)
+{
+	u64 now, interval, wait = 0;
+
+	spin_lock(&sf->rate_lock);
+	if (sf->rate) {
+		now = ktime_get_ns();
+		interval = NSEC_PER_SEC / sf->rate;
+		if (sf->tat < now)
+			sf->tat = now;
+		if (sf->tat - now > interval * (sf->burst - 1))
+			wait = sf->tat - now - interval * (sf->burst - 1);
+		else
+			sf->tat += interval;
+	}
+	spin_unlock(&sf->rate_lock);
+	return wait;
+}
+
+/*
+ * Blocking opens are throttled by sleeping until a token is due;
+ * O_NONBLOCK opens get -EAGAIN instead.
+ */
+static int scull_rate_acquire(struct file *filp)
+{
+	struct scull_file *sf = filp->private_data;
+	bool counted = false;
+	u64 wait;
+
+	while ((wait = scull_rate_take(sf))) {
+		if (!counted) {
+			spin_lock(&sf->rate_lock);
+			sf->throttled++;
+			spin_unlock(&sf->rate_lock);
+			atomic_long_inc(&scull_throttled);
+			counted = true;
+		}
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		schedule_timeout_interruptible(max_t(unsigned long, nsecs_to_jiffies(wait), 1));
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+static inline int scull_rate_check(struct file *filp)
+{
+	if (!static_branch_unlikely(&scull_ratelimit_key))
+		return 0;
+	return scull_rate_acquire(filp);
+}
+
+/*
+ * Subscription sets. Each fd can narrow what its read() streams and poll()
+ * report to a set of pids and tgids (SCULL_IOCSUB); a task is in if either
+ * its pid or its tgid is. An empty set means every task. A watch fd takes
+ * a copy of the set of the fd it was created from. The sets are XArrays of
+ * value entries, changed under the fd's read_lock; lookups need no lock.
+ */
+static void scull_subs_init(struct scull_subs *subs)
+{
+	xa_init(&subs->pids);
+	xa_init(&subs->tgids);
+	subs->count = 0;
+	subs->stamp = 0;
+}
+
+static void scull_subs_destroy(struct scull_subs *subs)
+{
+	xa_destroy(&subs->pids);
+	xa_destroy(&subs->tgids);
+	WRITE_ONCE(subs->count, 0);
+}
+
+static bool scull_subscribed(struct scull_subs *subs, pid_t pid, pid_t tgid)
+{
+	if (!READ_ONCE(subs->count))
+		return true;
+	return xa_load(&subs->pids, pid) || xa_load(&subs->tgids, tgid);
+}
+
+/* dst is fresh; called with src's owner read_lock held */
+static int scull_subs_copy(struct scull_subs *dst, struct scull_subs *src)
+{
+	unsigned long idx;
+	void *entry;
+	int err;
+
+	xa_for_each(&src->pids, idx, entry) {
+		err = xa_err(xa_store(&dst->pids, idx, entry, GFP_KERNEL));
+		if (err)
+			goto fail;
+	}
+	xa_for_each(&src->tgids, idx, entry) {
+		err = xa_err(xa_store(&dst->tgids, idx, entry, GFP_KERNEL));
+		if (err)
+			goto fail;
+	}
+	dst->count = src->count;
+	return 0;
+fail:
+	scull_subs_destroy(dst);
+	return err;
+}
+
+/*
+ * All or nothing: entries this call inserts carry a new stamp, so if an
+ * allocation fails partway they can be told from older ones and taken
+ * out again. Erasing never allocates.
+ */
+static int scull_subs_add(struct scull_subs *subs, struct xarray *set,
+			  const pid_t *ids, unsigned int n)
+{
+	void *tag = xa_mk_value(++subs->stamp & LONG_MAX);
+	unsigned long added = 0;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		err = xa_insert(set, ids[i], tag, GFP_KERNEL);
+		if (err == -EBUSY)	/* already in, or twice in ids */
+			err = 0;
+		else if (err)
+			break;
+		else
+			added++;
+	}
+	if (err) {
+		while (i--) {
+			if (xa_load(set, ids[i]) == tag)
+				xa_erase(set, ids[i]);
+		}
+		return err;
+	}
+	WRITE_ONCE(subs->count, subs->count + added);
+	return 0;
+}
+
+static void scull_subs_del(struct scull_subs *subs, struct xarray *set,
+			   const pid_t *ids, unsigned int n)
+{
+	unsigned long removed = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (xa_erase(set, ids[i]))
+			removed++;
+	}
+	WRITE_ONCE(subs->count, subs->count - removed);
+}
+
+static int scull_sub_ioctl(struct scull_file *sf, const struct scull_sub *sub)
+{
+	struct xarray *set;
+	pid_t *ids = NULL;
+	unsigned int i;
+	int retval = 0;
+
+	if (sub->kind != SCULL_SUB_PID && sub->kind != SCULL_SUB_TGID)
+		return -EINVAL;
+	if (sub->count > SCULL_SUB_MAX)
+		return -E2BIG;
+	set = sub->kind == SCULL_SUB_PID ? &sf->subs.pids : &sf->subs.tgids;
+
+	switch (sub->op) {
+	case SCULL_SUB_ADD:
+	case SCULL_SUB_DEL:
+		ids = vmemdup_user((const void __user *)sub->ids,
+				   array_size(sub->count, sizeof(*ids)));
+		if (IS_ERR(ids))
+			return PTR_ERR(ids);
+		/* Check every id before changing anything */
+		for (i = 0; i < sub->count; i++) {
+			if (ids[i] <= 0) {
+				kvfree(ids);
+				return -EINVAL;
+			}
+		}
+		mutex_lock(&sf->read_lock);
+		if (sub->op == SCULL_SUB_ADD)
+			retval = scull_subs_add(&sf->subs, set, ids, sub->count);
+		else
+			scull_subs_del(&sf->subs, set, ids, sub->count);
+		mutex_unlock(&sf->read_lock);
+		kvfree(ids);
+		break;
+	case SCULL_SUB_CLEAR:
+		mutex_lock(&sf->read_lock);
+		scull_subs_destroy(&sf->subs);
+		mutex_unlock(&sf->read_lock);
+		break;
+	default:
+		retval = -EINVAL;
+	}
+	return retval;
+}
+
+/*
+ * Sampler and alerts. An open file can attach up to SCULL_ALERTS_MAX rules
+ * (SCULL_IOCALERT), each an eventfd plus a per-second threshold on one
+ * tgid's registered tasks. While any rule exists a delayed work item takes
+ * a sample every scull_sample_ms: one RCU walk of the registry feeding
+ * every rule, then each rule turns its delta into a rate. Deltas are taken
+ * per task against what it showed at the previous sample (or at insert),
+ * so tasks joining or leaving a tgid do not move its sum. A rule signals
+ * its eventfd when the rate first goes over the threshold and re-arms once
+ * it drops back; a new rule only primes on its first sample. Closing the
+ * file drops its rules.
+ *
+ * Each sample also appends one struct scull_sample per live registered
+ * task to the sample ring, mapped read-only at SCULL_MMAP_SAMPLES_OFF: a
+ * header page, then scull_sample_ring_mb (rounded down to a power of two)
+ * of records. The records sit in physically contiguous chunks of up to
+ * 2MB, so the producer addresses them through the kernel's large-page
+ * direct map and a 64-byte record never straddles a chunk. head is only
+ * published (store-release) once a whole sample is written; the ring
+ * overwrites, so a reader re-checks head after copying to detect that it
+ * was lapped. Alert rules, mappings of the ring and ring consumers are
+ * the sampler's users: it runs while there is at least one.
+ *
+ * A ring consumer is an fd reading the ring with read() (SCULL_IOCRING),
+ * each with its own cursor. An overwrite consumer that falls a whole ring
+ * behind skips ahead and counts what it missed. A drop consumer instead
+ * holds the producer back: records that would overwrite what the slowest
+ * drop consumer has not read are not written at all, and are counted in
+ * the header's dropped. Either way, a consumer's lost count is what it
+ * never got. Consumers copy under scull_alert_mutex, so the producer
+ * cannot overwrite a record while it is being read.
+ */
+#define SCULL_ALERTS_MAX	16
+
+struct scull_alert_rule {
+	struct list_head list;
+	struct file *owner;
+	struct eventfd_ctx *ctx;
+	unsigned int kind;
+	pid_t tgid;
+	unsigned int threshold;
+	u64 sum;			/* SCULL_ALERT_NIVCSW */
+	u64 max;			/* SCULL_ALERT_MIGRATIONS */
+	bool primed;
+	bool tripped;
+};
+
+static LIST_HEAD(scull_alert_rules);
+static DEFINE_MUTEX(scull_alert_mutex);	/* rules, users, and serializes samples */
+static unsigned int scull_sample_users;
+static unsigned long scull_sample_last;	/* jiffies */
+static u64 scull_sample_seq;
+static atomic_long_t scull_alerts_fired = ATOMIC_LONG_INIT(0);
+
+static struct scull_sample_ring *scull_ring_hdr;	/* the header page */
+static struct page **scull_ring_chunks;
+static unsigned int scull_ring_nr_chunks;
+static unsigned int scull_ring_order;		/* of each chunk */
+static u64 scull_ring_nr;			/* records, a power of two */
+static LIST_HEAD(scull_ring_consumers);
+static DECLARE_WAIT_QUEUE_HEAD(scull_ring_wait);
+
+static void scull_sample_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_sample_work, scull_sample_fn);
+
+static unsigned long scull_sample_period(void)
+{
+	return max(msecs_to_jiffies(READ_ONCE(scull_sample_ms)), 1UL);
+}
+
+/* Called with scull_alert_mutex held */
+static void scull_sample_get(void)
+{
+	if (!scull_sample_users++) {
+		scull_sample_last = jiffies;
+		schedule_delayed_work(&scull_sample_work, scull_sample_period());
+	}
+}
+
+/* Called with scull_alert_mutex held; the sampler stops by itself */
+static void scull_sample_put(void)
+{
+	scull_sample_users--;
+}
+
+static int scull_sample_ring_alloc(unsigned long bytes, unsigned int order)
+{
+	unsigned int i, n = bytes >> (order + PAGE_SHIFT);
+	struct page **chunks;
+
+	chunks = kcalloc(n, sizeof(*chunks), GFP_KERNEL);
+	if (!chunks)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		chunks[i] = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN |
+					(order ? __GFP_NORETRY : 0), order);
+		if (!chunks[i]) {
+			while (i--)
+				__free_pages(chunks[i], order);
+			kfree(chunks);
+			return -ENOMEM;
+		}
+	}
+	scull_ring_chunks = chunks;
+	scull_ring_nr_chunks = n;
+	scull_ring_order = order;
+	return 0;
+}
+
+/* Largest chunks first, down to single pages if memory is fragmented */
+static int scull_sample_ring_init(void)
+{
+	unsigned long bytes;
+	unsigned int order;
+
+	BUILD_BUG_ON(!is_power_of_2(sizeof(struct scull_sample)));
+	if (!scull_sample_ring_mb)
+		return 0;
+	bytes = rounddown_pow_of_two(scull_sample_ring_mb) * SZ_1M;
+
+	scull_ring_hdr = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!scull_ring_hdr)
+		return -ENOMEM;
+	order = min3(get_order(SZ_2M), get_order(bytes), MAX_ORDER - 1);
+	while (scull_sample_ring_alloc(bytes, order)) {
+		if (!order--)
+			return -ENOMEM;
+	}
+	scull_ring_nr = bytes / sizeof(struct scull_sample);
+	scull_ring_hdr->nr = scull_ring_nr;
+	scull_ring_hdr->size = sizeof(struct scull_sample);
+	scull_ring_hdr->data_off = PAGE_SIZE;
+	return 0;
+}
+
+static void scull_sample_ring_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < scull_ring_nr_chunks; i++)
+		__free_pages(scull_ring_chunks[i], scull_ring_order);
+	kfree(scull_ring_chunks);
+	free_page((unsigned long)scull_ring_hdr);
+}
+
+static struct scull_sample *scull_sample_slot(u64 idx)
+{
+	unsigned int shift = scull_ring_order + PAGE_SHIFT - ilog2(sizeof(struct scull_sample));
+	unsigned long slot = idx & (scull_ring_nr - 1);
+
+	return (struct scull_sample *)page_address(scull_ring_chunks[slot >> shift]) +
+		(slot & ((1UL << shift) - 1));
+}
+
+struct scull_sample_ctl {
+	u64 next;		/* ring index of the next record */
+	u64 limit;		/* first index a drop consumer has not freed */
+	u64 dropped;
+};
+
+/* Called under rcu_read_lock() with scull_alert_mutex held */
+static bool scull_sample_one(struct task_info_node *node, void *arg)
+{
+	struct scull_sample_ctl *ctl = arg;
+	struct scull_alert_rule *rule;
+	struct task_struct *task;
+	struct scull_sample *rec;
+	u64 migr, delta;
+	unsigned long niv, niv_delta;
+
+	if (test_bit(SCULL_NODE_EXITED, &node->flags))
+		return true;
+	task = pid_task(find_pid_ns(node->pid, &init_pid_ns), PIDTYPE_PID);
+	if (!task || task->tgid != node->tgid)
+		return true;
+
+	if (scull_ring_hdr && ctl->next < ctl->limit) {
+		rec = scull_sample_slot(ctl->next++);
+		rec->ts_ns = ktime_get_ns();
+		rec->seq = scull_sample_seq;
+		scull_fill_info(&rec->info, task);
+	} else if (scull_ring_hdr) {
+		ctl->dropped++;
+	}
+
+	migr = READ_ONCE(task->se.nr_migrations);
+	delta = migr - node->sample_migr;
+	node->sample_migr = migr;
+	niv = READ_ONCE(task->nivcsw);
+	niv_delta = niv - node->sample_nivcsw;
+	node->sample_nivcsw = niv;
+
+	list_for_each_entry(rule, &scull_alert_rules, list) {
+		if (rule->tgid != node->tgid)
+			continue;
+		switch (rule->kind) {
+		case SCULL_ALERT_NIVCSW:
+			rule->sum += niv_delta;
+			break;
+		case SCULL_ALERT_MIGRATIONS:
+			rule->max = max(rule->max, delta);
+			break;
+		}
+	}
+	return true;
+}
+
+static void scull_alert_eval(struct scull_alert_rule *rule, unsigned int elapsed_ms)
+{
+	u64 value = 0;
+
+	switch (rule->kind) {
+	case SCULL_ALERT_NIVCSW:
+		value = rule->sum;
+		break;
+	case SCULL_ALERT_MIGRATIONS:
+		value = rule->max;
+		break;
+	}
+	value = div_u64(value * MSEC_PER_SEC, elapsed_ms);
+
+	if (rule->primed && value > rule->threshold) {
+		if (!rule->tripped) {
+			eventfd_signal(rule->ctx, 1);
+			atomic_long_inc(&scull_alerts_fired);
+		}
+		rule->tripped = true;
+	} else {
+		rule->tripped = false;
+	}
+	rule->primed = true;
+	rule->sum = 0;
+	rule->max = 0;
+}
+
+static void scull_sample_fn(struct work_struct *work)
+{
+	struct scull_sample_ctl ctl = { .limit = U64_MAX };
+	struct scull_alert_rule *rule;
+	struct scull_file *sf;
+	unsigned int elapsed_ms;
+
+	mutex_lock(&scull_alert_mutex);
+	elapsed_ms = max(jiffies_to_msecs(jiffies - scull_sample_last), 1U);
+	scull_sample_last = jiffies;
+
+	if (scull_ring_hdr) {
+		ctl.next = scull_ring_hdr->head;
+		list_for_each_entry(sf, &scull_ring_consumers, ring_list) {
+			if (sf->ring_policy == SCULL_RING_DROP)
+				ctl.limit = min(ctl.limit, sf->ring_tail + scull_ring_nr);
+		}
+	}
+	rcu_read_lock();
+	scull_ops->walk(0, scull_sample_one, &ctl);
+	rcu_read_unlock();
+	if (scull_ring_hdr) {
+		scull_ring_hdr->dropped += ctl.dropped;
+		smp_store_release(&scull_ring_hdr->head, ctl.next);
+		wake_up_interruptible(&scull_ring_wait);
+	}
+	scull_sample_seq++;
+
+	list_for_each_entry(rule, &scull_alert_rules, list)
+		scull_alert_eval(rule, elapsed_ms);
+
+	if (scull_sample_users)
+		schedule_delayed_work(&scull_sample_work, scull_sample_period());
+	mutex_unlock(&scull_alert_mutex);
+}
+
+static void scull_sample_vm_open(struct vm_area_struct *vma)
+{
+	mutex_lock(&scull_alert_mutex);
+	scull_sample_get();
+	mutex_unlock(&scull_alert_mutex);
+}
+
+static void scull_sample_vm_close(struct vm_area_struct *vma)
+{
+	mutex_lock(&scull_alert_mutex);
+	scull_sample_put();
+	mutex_unlock(&scull_alert_mutex);
+}
+
+static const struct vm_operations_struct scull_sample_vm_ops = {
+	.open =     scull_sample_vm_open,
+	.close =    scull_sample_vm_close,
+};
+
+/* The header page, then the chunks in order: one linear view of the ring */
+static int scull_sample_mmap(struct vm_area_struct *vma)
+{
+	unsigned long addr = vma->vm_start, chunk = PAGE_SIZE << scull_ring_order;
+	unsigned long len;
+	unsigned int i;
+	int err;
+
+	if (!scull_ring_hdr)
+		return -ENODEV;
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE + scull_ring_nr_chunks * chunk)
+		return -EINVAL;
+
+	err = remap_pfn_range(vma, addr, virt_to_phys(scull_ring_hdr) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	addr += PAGE_SIZE;
+	for (i = 0; !err && addr < vma->vm_end; i++) {
+		len = min(chunk, vma->vm_end - addr);
+		err = remap_pfn_range(vma, addr, page_to_pfn(scull_ring_chunks[i]),
+				      len, vma->vm_page_prot);
+		addr += len;
+	}
+	if (err)
+		return err;
+
+	vma->vm_ops = &scull_sample_vm_ops;
+	scull_sample_vm_open(vma);
+	return 0;
+}
+
+/* Called with scull_alert_mutex held */
+static int scull_ring_attach(struct scull_file *sf, unsigned int policy)
+{
+	if (!scull_ring_hdr)
+		return -ENODEV;
+	if (list_empty(&sf->ring_list)) {
+		sf->ring_tail = scull_ring_hdr->head;
+		sf->ring_lost = 0;
+		sf->ring_dropped = scull_ring_hdr->dropped;
+		list_add(&sf->ring_list, &scull_ring_consumers);
+		scull_sample_get();
+	}
+	sf->ring_policy = policy;
+	return 0;
+}
+
+/* Called with scull_alert_mutex held */
+static void scull_ring_detach(struct scull_file *sf)
+{
+	if (list_empty(&sf->ring_list))
+		return;
+	list_del_init(&sf->ring_list);
+	scull_sample_put();
+}
+
+/* Called with scull_alert_mutex held */
+static void scull_ring_stat(struct scull_file *sf, struct scull_ring_consumer *rc)
+{
+	rc->policy = sf->ring_policy;
+	rc->head = scull_ring_hdr->head;
+	rc->tail = sf->ring_tail;
+	rc->lost = sf->ring_lost + scull_ring_hdr->dropped - sf->ring_dropped;
+}
+
+static int scull_ring_ioctl(struct scull_file *sf, struct scull_ring_consumer *rc)
+{
+	int retval;
+
+	if (rc->policy != SCULL_RING_OVERWRITE && rc->policy != SCULL_RING_DROP)
+		return -EINVAL;
+	mutex_lock(&sf->read_lock);
+	mutex_lock(&scull_alert_mutex);
+	retval = scull_ring_attach(sf, rc->policy);
+	if (!retval) {
+		sf->read_mode = SCULL_READ_SAMPLES;
+		scull_ring_stat(sf, rc);
+	}
+	mutex_unlock(&scull_alert_mutex);
+	mutex_unlock(&sf->read_lock);
+	return retval;
+}
+
+/* Whether a read would find a record this fd is subscribed to */
+static bool scull_ring_ready(struct scull_file *sf)
+{
+	u64 head, tail;
+	bool ready;
+
+	if (!READ_ONCE(sf->subs.count))
+		return READ_ONCE(scull_ring_hdr->head) != READ_ONCE(sf->ring_tail);
+
+	mutex_lock(&scull_alert_mutex);
+	head = scull_ring_hdr->head;
+	tail = max(READ_ONCE(sf->ring_tail), head > scull_ring_nr ? head - scull_ring_nr : 0);
+	for (ready = false; !ready && tail != head; tail++) {
+		struct scull_sample *rec = scull_sample_slot(tail);
+
+		ready = scull_subscribed(&sf->subs, rec->info.pid, rec->info.tgid);
+	}
+	mutex_unlock(&scull_alert_mutex);
+	return ready;
+}
+
+/*
+ * Called with sf->read_lock held. Records go through a bounce page: they
+ * are taken under scull_alert_mutex, so the sampler cannot overwrite them
+ * halfway, and copied out after dropping it, since a fault on the user
+ * buffer takes mmap_lock, which the ring's vm_ops hold when they get here.
+ * The tail only moves past what was copied out.
+ */
+static ssize_t scull_read_samples(struct file *filp, struct scull_file *sf,
+				  struct iov_iter *to)
+{
+	const size_t size = sizeof(struct scull_sample);
+	const unsigned int batch = PAGE_SIZE / size;
+	u64 head, room, tail, *ends, done = 0;
+	struct scull_sample *bounce, *rec;
+	unsigned int k, copied;
+	ssize_t retval = 0;
+
+	room = iov_iter_count(to) / size;
+	if (!room)
+		return -EINVAL;
+	bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	ends = kmalloc_array(batch, sizeof(*ends), GFP_KERNEL);
+	if (!bounce || !ends) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	while (done < room) {
+		mutex_lock(&scull_alert_mutex);
+		while (sf->ring_tail == scull_ring_hdr->head) {
+			mutex_unlock(&scull_alert_mutex);
+			if (done)
+				goto out;
+			if (filp->f_flags & O_NONBLOCK) {
+				retval = -EAGAIN;
+				goto out;
+			}
+			if (wait_event_interruptible(scull_ring_wait,
+						     READ_ONCE(scull_ring_hdr->head) != sf->ring_tail)) {
+				retval = -ERESTARTSYS;
+				goto out;
+			}
+			mutex_lock(&scull_alert_mutex);
+		}
+
+		head = scull_ring_hdr->head;
+		if (head - sf->ring_tail > scull_ring_nr) {
+			sf->ring_lost += head - scull_ring_nr - sf->ring_tail;
+			sf->ring_tail = head - scull_ring_nr;
+		}
+
+		/* With a subscription set, other tasks' records are skipped */
+		for (k = 0, tail = sf->ring_tail; k < min_t(u64, batch, room - done) &&
+						  tail != head; ) {
+			rec = scull_sample_slot(tail++);
+			if (!scull_subscribed(&sf->subs, rec->info.pid, rec->info.tgid))
+				continue;
+			bounce[k] = *rec;
+			ends[k++] = tail;
+		}
+		if (!k)
+			sf->ring_tail = tail;	/* nothing of ours: wait for more */
+		mutex_unlock(&scull_alert_mutex);
+		if (!k)
+			continue;
+
+		copied = copy_to_iter(bounce, k * size, to) / size;
+		mutex_lock(&scull_alert_mutex);
+		if (copied == k)
+			sf->ring_tail = tail;
+		else if (copied)
+			sf->ring_tail = ends[copied - 1];
+		mutex_unlock(&scull_alert_mutex);
+		done += copied;
+		if (copied < k) {
+			if (!done)
+				retval = -EFAULT;
+			break;
+		}
+	}
+out:
+	kfree(ends);
+	kfree(bounce);
+	return done ? done * size : retval;
+}
+
+static int scull_alert_add(struct file *filp, const struct scull_alert *alert)
+{
+	struct scull_alert_rule *rule, *r;
+	struct eventfd_ctx *ctx;
+	unsigned int n = 0;
+
+	if (alert->kind != SCULL_ALERT_NIVCSW && alert->kind != SCULL_ALERT_MIGRATIONS)
+		return -EINVAL;
+	if (alert->tgid <= 0)
+		return -EINVAL;
+
+	ctx = eventfd_ctx_fdget(alert->efd);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+	rule = kzalloc(sizeof(*rule), GFP_KERNEL);
+	if (!rule) {
+		eventfd_ctx_put(ctx);
+		return -ENOMEM;
+	}
+	rule->owner = filp;
+	rule->ctx = ctx;
+	rule->kind = alert->kind;
+	rule->tgid = alert->tgid;
+	rule->threshold = alert->threshold;
+
+	mutex_lock(&scull_alert_mutex);
+	list_for_each_entry(r, &scull_alert_rules, list) {
+		if (r->owner == filp)
+			n++;
+	}
+	if (n >= SCULL_ALERTS_MAX) {
+		mutex_unlock(&scull_alert_mutex);
+		eventfd_ctx_put(ctx);
+		kfree(rule);
+		return -ENOSPC;
+	}
+	scull_sample_get();
+	list_add_tail(&rule->list, &scull_alert_rules);
+	mutex_unlock(&scull_alert_mutex);
+	return 0;
+}
+
+static void scull_alerts_release(struct file *filp)
+{
+	struct scull_alert_rule *rule, *tmp;
+
+	mutex_lock(&scull_alert_mutex);
+	list_for_each_entry_safe(rule, tmp, &scull_alert_rules, list) {
+		if (rule->owner != filp)
+			continue;
+		list_del(&rule->list);
+		eventfd_ctx_put(rule->ctx);
+		kfree(rule);
+		scull_sample_put();
+	}
+	mutex_unlock(&scull_alert_mutex);
+}
+
+/*
+ * mmap: the offset selects which buffer is mapped. All of them are
+ * read-only to user space.
+ */
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	switch (vma->vm_pgoff << PAGE_SHIFT) {
+	case SCULL_MMAP_SWITCH_OFF:
+		if (size > nr_cpu_ids * scull_switch_ring_size)
+			return -EINVAL;
+		return remap_vmalloc_range(vma, scull_switch_rings, 0);
+	case SCULL_MMAP_SAMPLES_OFF:
+		return scull_sample_mmap(vma);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Open and close
+ */
+
+static int scull_open(struct inode *inode, struct file *filp)
+{
+	struct scull_file *sf;
+
+	sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+	if (!sf)
+		return -ENOMEM;
+	spin_lock_init(&sf->rate_lock);
+	scull_rate_set(sf, scull_rate_limit, scull_rate_burst);
+	mutex_init(&sf->read_lock);
+	xa_init(&sf->read_seen);
+	INIT_LIST_HEAD(&sf->ring_list);
+	scull_subs_init(&sf->subs);
+	filp->private_data = sf;
+
+	printk(KERN_INFO "scull open\n");
+	return 0;          /* success */
+}
+
+static int scull_release(struct inode *inode, struct file *filp)
+{
+	struct scull_file *sf = filp->private_data;
+
+	scull_alerts_release(filp);
+	mutex_lock(&scull_alert_mutex);
+	scull_ring_detach(sf);
+	mutex_unlock(&scull_alert_mutex);
+	xa_destroy(&sf->read_seen);
+	scull_subs_destroy(&sf->subs);
+	kvfree(sf->zprev);
+	kfree(sf);
+	printk(KERN_INFO "scull close\n");
+	return 0;
+}
+
+/*
+ * Stuck-task watchdog. While anyone holds a watch fd (SCULL_IOCWATCH), a
+ * delayed work item scans the registry every quarter of scull_stuck_ms
+ * (at most once a second) and reports each task whose context-switch
+ * counts have not moved for scull_stuck_ms while it is either on a CPU
+ * or in an uninterruptible sleep that counts toward the load average,
+ * which includes TASK_KILLABLE. Tasks asleep in TASK_INTERRUPTIBLE or
+ * TASK_IDLE are idle, not stuck. A task is reported once per episode; it becomes
+ * eligible again when it switches.
+ *
+ * Each watch fd has its own small kfifo of struct scull_stuck records:
+ * the scan is the only producer (under scull_watch_lock) and reads are
+ * serialized per fd, so the fifo itself needs no lock. Records that do
+ * not fit are counted in scull_watch_lost. A watcher only gets records
+ * for tasks in its subscription set.
+ */
+#define SCULL_WATCH_EVENTS	64
+
+struct scull_watcher {
+	struct list_head list;
+	wait_queue_head_t wait;
+	struct mutex read_lock;
+	struct scull_subs subs;		/* copied at creation, then fixed */
+	DECLARE_KFIFO(events, struct scull_stuck, SCULL_WATCH_EVENTS);
+};
+
+static LIST_HEAD(scull_watchers);
+static DEFINE_SPINLOCK(scull_watch_lock);
+static atomic_long_t scull_watch_lost = ATOMIC_LONG_INIT(0);
+
+static void scull_watch_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_watch_work, scull_watch_fn);
+
+static unsigned long scull_watch_period(void)
+{
+	return max_t(unsigned long, msecs_to_jiffies(READ_ONCE(scull_stuck_ms)) / 4, HZ);
+}
+
+static void scull_watch_post(const struct scull_stuck *ev)
+{
+	struct scull_watcher *w;
+
+	spin_lock(&scull_watch_lock);
+	list_for_each_entry(w, &scull_watchers, list) {
+		if (!scull_subscribed(&w->subs, ev->pid, ev->tgid))
+			continue;
+		if (!kfifo_put(&w->events, *ev))
+			atomic_long_inc(&scull_watch_lost);
+		wake_up_interruptible(&w->wait);
+	}
+	spin_unlock(&scull_watch_lock);
+}
+
+/* Called under rcu_read_lock(); only the watchdog touches watch_* */
+static bool scull_watch_one(struct task_info_node *node, void *arg)
+{
+	struct task_struct *task;
+	struct scull_stuck ev = { .pad = 0 };
+	unsigned long csw;
+	long state;
+
+	if (test_bit(SCULL_NODE_EXITED, &node->flags))
+		return true;
+	task = pid_task(find_pid_ns(node->pid, &init_pid_ns), PIDTYPE_PID);
+	if (!task || task->tgid != node->tgid)
+		return true;
+
+	csw = READ_ONCE(task->nvcsw) + READ_ONCE(task->nivcsw);
+	state = READ_ONCE(task->state);
+	if (csw != node->watch_csw ||
+	    (state != TASK_RUNNING &&
+	     (!(state & TASK_UNINTERRUPTIBLE) || (state & TASK_NOLOAD)))) {
+		node->watch_csw = csw;
+		node->watch_since = jiffies;
+		clear_bit(SCULL_NODE_STUCK, &node->flags);
+		return true;
+	}
+	if (time_before(jiffies, node->watch_since + msecs_to_jiffies(READ_ONCE(scull_stuck_ms))))
+		return true;
+	if (test_and_set_bit(SCULL_NODE_STUCK, &node->flags))
+		return true;
+
+	ev.pid = node->pid;
+	ev.tgid = node->tgid;
+	ev.state = state;
+	ev.nvcsw = task->nvcsw;
+	ev.nivcsw = task->nivcsw;
+	ev.stuck_ms = jiffies_to_msecs(jiffies - node->watch_since);
+	scull_watch_post(&ev);
+	return true;
+}
+
+static void scull_watch_fn(struct work_struct *work)
+{
+	rcu_read_lock();
+	scull_ops->walk(0, scull_watch_one, NULL);
+	rcu_read_unlock();
+
+	spin_lock(&scull_watch_lock);
+	if (!list_empty(&scull_watchers))
+		schedule_delayed_work(&scull_watch_work, scull_watch_period());
+	spin_unlock(&scull_watch_lock);
+}
+
+static ssize_t scull_watch_read(struct file *filp, char __user *buf, size_t count,
+				loff_t *f_pos)
+{
+	struct scull_watcher *w = filp->private_data;
+	unsigned int copied;
+	int ret;
+
+	if (count < sizeof(struct scull_stuck))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&w->read_lock))
+		return -ERESTARTSYS;
+	while (kfifo_is_empty(&w->events)) {
+		mutex_unlock(&w->read_lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(w->wait, !kfifo_is_empty(&w->events)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&w->read_lock))
+			return -ERESTARTSYS;
+	}
+	ret = kfifo_to_user(&w->events, buf, count, &copied);
+	mutex_unlock(&w->read_lock);
+	return ret ? ret : copied;
+}
+
+static __poll_t scull_watch_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_watcher *w = filp->private_data;
+
+	poll_wait(filp, &w->wait, wait);
+	return kfifo_is_empty(&w->events) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static int scull_watch_release(struct inode *inode, struct file *filp)
+{
+	struct scull_watcher *w = filp->private_data;
+
+	spin_lock(&scull_watch_lock);
+	list_del(&w->list);
+	if (list_empty(&scull_watchers))
+		cancel_delayed_work(&scull_watch_work);
+	spin_unlock(&scull_watch_lock);
+	scull_subs_destroy(&w->subs);
+	kfree(w);
+	return 0;
+}
+
+static const struct file_operations scull_watch_fops = {
+	.owner =    THIS_MODULE,
+	.read =     scull_watch_read,
+	.poll =     scull_watch_poll,
+	.release =  scull_watch_release,
+	.llseek =   noop_llseek,
+};
+
+/* Returns a new watch fd, subscribed to what sf is subscribed to */
+static int scull_watch_open(struct scull_file *sf)
+{
+	struct scull_watcher *w;
+	bool first;
+	int fd, err;
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+	INIT_KFIFO(w->events);
+	init_waitqueue_head(&w->wait);
+	mutex_init(&w->read_lock);
+	scull_subs_init(&w->subs);
+	mutex_lock(&sf->read_lock);
+	err = scull_subs_copy(&w->subs, &sf->subs);
+	mutex_unlock(&sf->read_lock);
+	if (err) {
+		kfree(w);
+		return err;
+	}
+
+	/* On the list before the fd exists, so release always finds it there */
+	spin_lock(&scull_watch_lock);
+	first = list_empty(&scull_watchers);
+	list_add(&w->list, &scull_watchers);
+	if (first)
+		schedule_delayed_work(&scull_watch_work, scull_watch_period());
+	spin_unlock(&scull_watch_lock);
+
+	fd = anon_inode_getfd("[scull-watch]", &scull_watch_fops, w, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		spin_lock(&scull_watch_lock);
+		list_del(&w->list);
+		spin_unlock(&scull_watch_lock);
+		scull_subs_destroy(&w->subs);
+		kfree(w);
+	}
+	return fd;
+}
+
+/*
+ * Debugfs: /sys/kernel/debug/scull/
+ */
+
+static struct dentry *scull_debugfs_dir;
+
+static unsigned long scull_percpu_sum(unsigned long __percpu *counter)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(counter, cpu);
+	return sum;
+}
+
+static int scull_stats_show(struct seq_file *m, void *v)
+{
+	struct scull_lookup_cache *cache;
+	unsigned long hits = 0, misses = 0;
+	int cpu;
+
+	seq_printf(m, "backend %s\n", scull_ops->name);
+	seq_printf(m, "nodes %ld\n", atomic_long_read(&scull_nr_nodes));
+	seq_printf(m, "followed %d\n", atomic_read(&scull_nr_followed));
+	seq_printf(m, "follow_dropped %ld\n", atomic_long_read(&scull_follow_dropped));
+	seq_printf(m, "pool %d\n", READ_ONCE(scull_node_pool_count));
+	seq_printf(m, "throttled %ld\n", atomic_long_read(&scull_throttled));
+	seq_printf(m, "combine_batches %ld\n", atomic_long_read(&scull_combine_batches));
+	seq_printf(m, "combined_inserts %ld\n", atomic_long_read(&scull_combined));
+	seq_printf(m, "deferred_inserts %ld\n", atomic_long_read(&scull_deferred));
+	seq_printf(m, "node_size %zu\n", sizeof(struct task_info_node));
+	seq_printf(m, "wake_dropped %ld\n", atomic_long_read(&scull_wake_dropped));
+	seq_printf(m, "offcpu_dropped %ld\n", atomic_long_read(&scull_offcpu_dropped));
+	seq_printf(m, "watch_lost %ld\n", atomic_long_read(&scull_watch_lost));
+	seq_printf(m, "alerts_fired %ld\n", atomic_long_read(&scull_alerts_fired));
+	seq_printf(m, "filter_hits %lu\n", scull_percpu_sum(&scull_filter_hits));
+	seq_printf(m, "filter_misses %lu\n", scull_percpu_sum(&scull_filter_misses));
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(&scull_lookup_cache, cpu);
+		hits += cache->hits;
+		misses += cache->misses;
+	}
+	seq_printf(m, "cache_hits %lu\n", hits);
+	seq_printf(m, "cache_misses %lu\n", misses);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+static int scull_cgroups_show(struct seq_file *m, void *v)
+{
+	struct scull_cgroup_count *cc;
+	int bkt;
+
+	mutex_lock(&task_info_node_mutex);
+	hash_for_each(scull_cgroup_counts, bkt, cc, hash)
+		seq_printf(m, "%llu %ld %zu\n", cc->cgid, cc->nr_nodes,
+			   cc->nr_nodes * sizeof(struct task_info_node));
+	scull_registry_unlock();
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_cgroups);
+
+static void scull_debugfs_init(void)
+{
+	scull_debugfs_dir = debugfs_create_dir("scull", NULL);
+	debugfs_create_file("stats", 0444, scull_debugfs_dir, NULL, &scull_stats_fops);
+	debugfs_create_file("cgroups", 0444, scull_debugfs_dir, NULL, &scull_cgroups_fops);
+}
+
+/*
+ * Ordered, cursor-based reads of the registry. Entries are copied out of
+ * the XArray under RCU into a bounce buffer, so no lock is held across
+ * calls (or across copy_to_user); range->next is the cursor to resume from.
+ * Live tasks are snapshotted afresh (and the entry updated); exited ones
+ * report the last snapshot taken.
+ */
+static void scull_refresh_node(struct task_info_node *node, struct task_info *info)
+{
+	struct task_struct *task;
+
+	task = pid_task(find_pid_ns(node->pid, &init_pid_ns), PIDTYPE_PID);
+	if (task && task->tgid == node->tgid && !test_bit(SCULL_NODE_EXITED, &node->flags)) {
+		scull_fill_info(info, task);
+		scull_node_set_info(node, info);
+	} else {
+		scull_node_get_info(node, info);
+	}
+}
+
+struct scull_collect {
+	struct task_info_node **nodes;
+	unsigned long n;
+	unsigned long max;
+	bool overflow;
+};
+
+static bool scull_collect_one(struct task_info_node *node, void *arg)
+{
+	struct scull_collect *c = arg;
+
+	if (c->n == c->max) {
+		c->overflow = true;
+		return false;
+	}
+	c->nodes[c->n++] = node;
+	return true;
+}
+
+static int scull_cmp_pid(const void *a, const void *b)
+{
+	const struct task_info_node *x = *(const struct task_info_node * const *)a;
+	const struct task_info_node *y = *(const struct task_info_node * const *)b;
+
+	return x->pid - y->pid;
+}
+
+/*
+ * Gathers the nodes at or after start in pid order. Ordered backends stop
+ * after limit entries. The others are walked in full and the nodes sorted,
+ * retrying with a bigger array if the registry grew while the array was
+ * being allocated. On success returns with rcu_read_lock() held; the
+ * caller unlocks and frees c->nodes.
+ */
+static int scull_collect_range(pid_t start, unsigned long limit, struct scull_collect *c)
+{
+	c->max = scull_ops->ordered ? limit : atomic_long_read(&scull_nr_nodes) + 64;
+	for (;;) {
+		c->nodes = kvmalloc_array(c->max, sizeof(*c->nodes), GFP_KERNEL);
+		if (!c->nodes)
+			return -ENOMEM;
+		c->n = 0;
+		c->overflow = false;
+
+		rcu_read_lock();
+		scull_ops->walk(start, scull_collect_one, c);
+		if (scull_ops->ordered || !c->overflow)
+			break;
+		rcu_read_unlock();
+		kvfree(c->nodes);
+		c->max *= 2;
+	}
+	if (!scull_ops->ordered)
+		sort(c->nodes, c->n, sizeof(*c->nodes), scull_cmp_pid, NULL);
+	return 0;
+}
+
+static int scull_read_range(struct scull_range *range)
+{
+	struct scull_collect c = { .nodes = NULL };
+	struct task_info *buf;
+	unsigned int max, n, i;
+	int retval = 0;
+
+	if (range->start < 0)
+		return -EINVAL;
+	max = min_t(unsigned int, range->count, SCULL_RANGE_MAX);
+	range->count = 0;
+	range->next = 0;
+	if (!max)
+		return 0;
+
+	buf = kvmalloc_array(max, sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	retval = scull_collect_range(range->start, max, &c);
+	if (retval)
+		goto out;
+
+	/* Still under RCU: the collected nodes stay valid until the unlock */
+	n = min_t(unsigned long, c.n, max);
+	for (i = 0; i < n; i++)
+		scull_refresh_node(c.nodes[i], &buf[i]);
+	if (n == max)
+		range->next = buf[n - 1].pid + 1;
+	rcu_read_unlock();
+	kvfree(c.nodes);
+
+	if (copy_to_user((void __user *)range->entries, buf, n * sizeof(*buf)))
+		retval = -EFAULT;
+	else
+		range->count = n;
+out:
+	kvfree(buf);
+	return retval;
+}
+
+/*
+ * Incremental sync: everything with a generation in (since, upto], lowest
+ * generations first. A first pass refreshes live tasks (bumping the
+ * generation of those that changed), then upto is fixed and a second pass
+ * collects; anything that changes after that is left for the next call.
+ * Only the count oldest changes are kept, in a max-heap on generation.
+ */
+struct scull_since_ctl {
+	struct scull_change *buf;
+	unsigned int n, max;
+	u64 since, upto;
+	bool more;
+};
+
+static void scull_heap_down(struct scull_change *h, unsigned int n, unsigned int i)
+{
+	unsigned int c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && h[c + 1].gen > h[c].gen)
+			c++;
+		if (h[i].gen >= h[c].gen)
+			break;
+		swap(h[i], h[c]);
+		i = c;
+	}
+}
+
+static void scull_since_add(struct scull_since_ctl *c, const struct scull_change *ch)
+{
+	unsigned int i;
+
+	if (ch->gen <= c->since || ch->gen > c->upto)
+		return;
+	if (c->n < c->max) {
+		c->buf[i = c->n++] = *ch;
+		while (i && c->buf[(i - 1) / 2].gen < c->buf[i].gen) {
+			swap(c->buf[i], c->buf[(i - 1) / 2]);
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+	c->more = true;
+	if (ch->gen < c->buf[0].gen) {
+		c->buf[0] = *ch;
+		scull_heap_down(c->buf, c->n, 0);
+	}
+}
+
+static bool scull_since_refresh(struct task_info_node *node, void *arg)
+{
+	struct task_info info;
+
+	scull_refresh_node(node, &info);
+	return true;
+}
+
+static bool scull_since_one(struct task_info_node *node, void *arg)
+{
+	struct scull_change ch = { .deleted = 0 };
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&node->lock);
+		ch.gen = node->gen;
+		ch.info = node->info;
+	} while (read_seqretry(&node->lock, seq));
+	scull_since_add(arg, &ch);
+	return true;
+}
+
+static int scull_cmp_gen(const void *a, const void *b)
+{
+	const struct scull_change *x = a, *y = b;
 
-static LIST_HEAD(task_info_node_list);
-static DEFINE_MUTEX(task_info_node_mutex);
+	return x->gen < y->gen ? -1 : x->gen > y->gen;
+}
 
-static struct cdev scull_cdev;		/* Char device structure */
+static int scull_read_since(struct scull_since *since)
+{
+	struct scull_since_ctl c = { .since = since->gen };
+	struct scull_change ch = { .deleted = 1 };
+	unsigned long i, head;
+	int retval = 0;
+
+	c.max = min_t(unsigned int, since->count, SCULL_SINCE_MAX);
+	since->count = 0;
+	since->flags = 0;
+	if (!c.max)
+		return -EINVAL;
+
+	spin_lock(&scull_tomb_lock);
+	if (c.since && c.since < scull_tomb_floor)
+		since->flags |= SCULL_SINCE_RESYNC;
+	spin_unlock(&scull_tomb_lock);
+	if (since->flags & SCULL_SINCE_RESYNC)
+		return 0;
+
+	c.buf = kvmalloc_array(c.max, sizeof(*c.buf), GFP_KERNEL);
+	if (!c.buf)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	scull_ops->walk(0, scull_since_refresh, NULL);
+	c.upto = atomic64_read(&scull_generation);
+	smp_rmb();	/* pairs with the insert's publish-then-stamp */
+	scull_ops->walk(0, scull_since_one, &c);
+	rcu_read_unlock();
+
+	/*
+	 * A full read (since 0) starts an empty mirror: no tombstones needed.
+	 * Deletes during the walk may have overwritten tombstones past since,
+	 * so the floor is checked again with the ones we collect.
+	 */
+	if (c.since) {
+		spin_lock(&scull_tomb_lock);
+		if (c.since < scull_tomb_floor) {
+			since->flags |= SCULL_SINCE_RESYNC;
+		} else {
+			head = scull_tomb_head;
+			for (i = head - min_t(unsigned long, head, scull_tombstones); i < head; i++) {
+				struct scull_tomb *t = &scull_tombs[i % scull_tombstones];
+
+				ch.gen = t->gen;
+				ch.info.pid = t->pid;
+				ch.info.tgid = t->tgid;
+				scull_since_add(&c, &ch);
+			}
+		}
+		spin_unlock(&scull_tomb_lock);
+		if (since->flags & SCULL_SINCE_RESYNC) {
+			kvfree(c.buf);
+			return 0;
+		}
+	}
+
+	sort(c.buf, c.n, sizeof(*c.buf), scull_cmp_gen, NULL);
+	if (c.more) {
+		since->flags |= SCULL_SINCE_MORE;
+		since->gen = c.buf[c.n - 1].gen;
+	} else {
+		since->gen = c.upto;
+	}
+
+	if (copy_to_user((void __user *)since->entries, c.buf, c.n * sizeof(*c.buf)))
+		retval = -EFAULT;
+	else
+		since->count = c.n;
+	kvfree(c.buf);
+	return retval;
+}
 
 /*
- * Open and close
+ * read() in SCULL_READ_DELTA mode: each pass over the registry, in pid
+ * order, returns a struct task_info for a task only if it differs from the
+ * last one this fd was sent for that pid. Per fd, the last record sent is
+ * kept as a hash in an XArray value entry, so an idle task costs a lookup
+ * and no copy. A read continues the pass where the previous one stopped;
+ * the read that finds it finished returns 0 and the next one starts over.
+ */
+static int scull_read_reset(struct scull_file *sf, unsigned int mode)
+{
+	int retval = 0;
+
+	mutex_lock(&sf->read_lock);
+	mutex_lock(&scull_alert_mutex);
+	if (mode == SCULL_READ_SAMPLES)
+		retval = scull_ring_attach(sf, SCULL_RING_OVERWRITE);
+	else
+		scull_ring_detach(sf);
+	mutex_unlock(&scull_alert_mutex);
+	if (!retval) {
+		sf->read_mode = mode;
+		sf->read_cursor = 0;
+		sf->read_eof = false;
+		xa_destroy(&sf->read_seen);
+	}
+	mutex_unlock(&sf->read_lock);
+	return retval;
+}
+
+static unsigned long scull_info_hash(const struct task_info *info)
+{
+	u64 h = (u64)jhash(info, sizeof(*info), 0) << 32 | jhash(info, sizeof(*info), 1);
+
+	return (unsigned long)h >> 2;	/* fits an XArray value entry */
+}
+
+/*
+ * Called under rcu_read_lock() once a pass has covered pids [start, end]:
+ * forget what was sent for pids in there that it did not return or skip
+ * as unchanged (gone, or not subscribed), so read_seen follows the
+ * registry instead of growing with every pid ever seen. nodes[0..n) are
+ * the ones visited, in pid order.
  */
+static void scull_read_prune(struct scull_file *sf, struct task_info_node **nodes,
+			     unsigned long n, pid_t start, pid_t end)
+{
+	unsigned long idx, j = 0;
+	void *entry;
 
-static int scull_open(struct inode *inode, struct file *filp)
+	xa_for_each_range(&sf->read_seen, idx, entry, start, end) {
+		while (j < n && nodes[j]->pid < idx)
+			j++;
+		if (j < n && nodes[j]->pid == idx &&
+		    scull_subscribed(&sf->subs, nodes[j]->pid, nodes[j]->tgid))
+			continue;
+		xa_erase(&sf->read_seen, idx);
+	}
+}
+
+static ssize_t scull_read_delta(struct scull_file *sf, struct iov_iter *to)
 {
-	printk(KERN_INFO "scull open\n");
-	return 0;          /* success */
+	struct scull_collect c;
+	struct task_info *buf;
+	unsigned long *hash, max, n = 0, i;
+	ssize_t retval;
+	pid_t start;
+	void *seen;
+
+	max = min_t(size_t, iov_iter_count(to) / sizeof(*buf), SCULL_RANGE_MAX);
+	if (!max)
+		return -EINVAL;
+	buf = kvmalloc_array(max, sizeof(*buf), GFP_KERNEL);
+	hash = kvmalloc_array(max, sizeof(*hash), GFP_KERNEL);
+	if (!buf || !hash) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&sf->read_lock);
+	if (sf->read_eof) {
+		sf->read_eof = false;
+		retval = 0;
+		goto unlock;
+	}
+	/* Only the end of a pass may return 0: go on while nothing changed */
+	do {
+		start = sf->read_cursor;
+		retval = scull_collect_range(start, atomic_long_read(&scull_nr_nodes) + 64, &c);
+		if (retval)
+			goto unlock;
+		for (i = 0; i < c.n && n < max; i++) {
+			if (!scull_subscribed(&sf->subs, c.nodes[i]->pid, c.nodes[i]->tgid))
+				continue;
+			scull_refresh_node(c.nodes[i], &buf[n]);
+			hash[n] = scull_info_hash(&buf[n]);
+			seen = xa_load(&sf->read_seen, buf[n].pid);
+			if (!seen || xa_to_value(seen) != hash[n])
+				n++;
+		}
+		/*
+		 * An ordered walk that filled c.nodes stopped early: carry on from
+		 * the next pid. Otherwise the pass is over once every node was seen.
+		 */
+		if (i < c.n)
+			sf->read_cursor = c.nodes[i]->pid;
+		else if (c.overflow)
+			sf->read_cursor = c.nodes[c.n - 1]->pid + 1;
+		else
+			sf->read_cursor = 0;
+		scull_read_prune(sf, c.nodes, i, start,
+				 sf->read_cursor ? sf->read_cursor - 1 : PID_MAX_LIMIT);
+		rcu_read_unlock();
+		kvfree(c.nodes);
+	} while (!n && sf->read_cursor);
+	sf->read_eof = !sf->read_cursor && n;
+
+	if (copy_to_iter(buf, n * sizeof(*buf), to) != n * sizeof(*buf)) {
+		retval = -EFAULT;
+		goto unlock;
+	}
+	for (i = 0; i < n; i++)
+		xa_store(&sf->read_seen, buf[i].pid, xa_mk_value(hash[i]), GFP_KERNEL);
+	retval = n * sizeof(*buf);
+unlock:
+	mutex_unlock(&sf->read_lock);
+out:
+	kvfree(hash);
+	kvfree(buf);
+	return retval;
 }
 
-static int scull_release(struct inode *inode, struct file *filp)
+/*
+ * read() goes through read_iter so the same stream can be spliced
+ * (generic_file_splice_read) into a pipe, and from there to a file or
+ * socket, without a user-space buffer in between.
+ */
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	printk(KERN_INFO "scull close\n");
+	struct file *filp = iocb->ki_filp;
+	struct scull_file *sf = filp->private_data;
+	ssize_t retval;
+
+	switch (READ_ONCE(sf->read_mode)) {
+	case SCULL_READ_DELTA:
+		retval = scull_rate_check(filp);
+		if (retval)
+			return retval;
+		return scull_read_delta(sf, to);
+	case SCULL_READ_SAMPLES:
+		mutex_lock(&sf->read_lock);
+		retval = scull_read_samples(filp, sf, to);
+		mutex_unlock(&sf->read_lock);
+		return retval;
+	default:
+		return -EINVAL;
+	}
+}
+
+static __poll_t scull_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_file *sf = filp->private_data;
+
+	if (READ_ONCE(sf->read_mode) != SCULL_READ_SAMPLES)
+		return EPOLLIN | EPOLLRDNORM;	/* never blocks */
+	poll_wait(filp, &scull_ring_wait, wait);
+	return scull_ring_ready(sf) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/*
+ * One pass over every thread on the system, in place of reading
+ * /proc/<pid>/task/<tid>/stat for each one. Records are gathered under RCU
+ * into a bounce buffer and copied out once; dump->total reports how many
+ * threads there were, so a caller whose buffer was too small can retry.
+ */
+static int scull_dump_tasks(struct scull_dump *dump)
+{
+	struct task_struct *g, *t;
+	struct task_info *buf;
+	unsigned int max, n = 0, total = 0;
+	int retval = 0;
+
+	/*
+	 * Size the buffer from the threads there are, not from what the
+	 * caller offers: nr_threads is not exported, so count them first.
+	 * Threads created in between show up in total.
+	 */
+	rcu_read_lock();
+	for_each_process_thread(g, t)
+		total++;
+	rcu_read_unlock();
+	max = min_t(unsigned int, min_t(unsigned int, dump->count, SCULL_DUMP_MAX),
+		    total + 64);
+	buf = kvmalloc_array(max ? max : 1, sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	total = 0;
+	rcu_read_lock();
+	for_each_process_thread(g, t) {
+		if (n < max)
+			scull_fill_info(&buf[n++], t);
+		total++;
+	}
+	rcu_read_unlock();
+
+	if (copy_to_user((void __user *)dump->entries, buf, n * sizeof(*buf)))
+		retval = -EFAULT;
+	dump->count = n;
+	dump->total = total;
+	kvfree(buf);
+	return retval;
+}
+
+/*
+ * One fixed-layout record per online CPU. curr and nr_switches come from
+ * the sched_switch probe; nr_running counts TASK_RUNNING threads by the CPU
+ * they last ran on, in one RCU pass over the task list.
+ */
+static int scull_read_cpus(struct scull_cpus *cpus)
+{
+	struct scull_cpu_info *buf;
+	struct task_struct *g, *t;
+	unsigned int *nr_running;
+	unsigned int max, n = 0;
+	int cpu, retval = 0;
+
+	if (!scull_feature_cpustat.enabled)
+		return -EOPNOTSUPP;
+
+	max = min_t(unsigned int, cpus->count, nr_cpu_ids);
+	buf = kcalloc(max ? max : 1, sizeof(*buf), GFP_KERNEL);
+	nr_running = kcalloc(nr_cpu_ids, sizeof(*nr_running), GFP_KERNEL);
+	if (!buf || !nr_running) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	rcu_read_lock();
+	for_each_process_thread(g, t) {
+		if (READ_ONCE(t->state) == TASK_RUNNING)
+			nr_running[task_cpu(t)]++;
+	}
+	rcu_read_unlock();
+
+	for_each_online_cpu(cpu) {
+		struct scull_cpu_stat *cs = per_cpu_ptr(&scull_cpu_stat, cpu);
+
+		if (n == max)
+			break;
+		buf[n].cpu = cpu;
+		buf[n].curr = READ_ONCE(cs->curr);
+		buf[n].nr_running = nr_running[cpu];
+		buf[n].nr_switches = READ_ONCE(cs->nr_switches);
+		n++;
+	}
+
+	if (copy_to_user((void __user *)cpus->entries, buf, n * sizeof(*buf)))
+		retval = -EFAULT;
+	cpus->count = n;
+out:
+	kfree(nr_running);
+	kfree(buf);
+	return retval;
+}
+
+/*
+ * Compressed bulk export (SCULL_IOCZEXPORT). Records are sorted by pid and
+ * encoded as LEB128 varints, pids as deltas from the previous record and
+ * the switch counters as deltas from the same pid's values in this fd's
+ * previous export, which is kept (pid and counters only) for the next
+ * call. Signed values are zigzag-coded. The layout is described in
+ * scull.h; src/scull_decode.c is the reference decoder.
+ */
+struct scull_zprev {
+	pid_t pid;
+	unsigned long nvcsw;
+	unsigned long nivcsw;
+};
+
+static u8 *scull_put_varint(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static u64 scull_zigzag(s64 v)
+{
+	return ((u64)v << 1) ^ (u64)(v >> 63);
+}
+
+static int scull_cmp_info_pid(const void *a, const void *b)
+{
+	const struct task_info *x = a, *y = b;
+
+	return x->pid - y->pid;
+}
+
+/* Snapshot of the source into a new array sorted by pid */
+static int scull_zcollect(unsigned int source, struct task_info **recs, unsigned long *nr)
+{
+	struct scull_collect c = { .nodes = NULL };
+	struct task_struct *g, *t;
+	struct task_info *buf;
+	unsigned long max = 4096, n, i;
+	bool overflow;
+	int retval;
+
+	for (;;) {
+		if (source == SCULL_Z_REGISTRY)
+			max = max_t(unsigned long, max, atomic_long_read(&scull_nr_nodes) + 64);
+		buf = kvmalloc_array(max, sizeof(*buf), GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		n = 0;
+
+		if (source == SCULL_Z_DUMP) {
+			overflow = false;
+			rcu_read_lock();
+			for_each_process_thread(g, t) {
+				if (n < max)
+					scull_fill_info(&buf[n++], t);
+				else
+					overflow = true;
+			}
+			rcu_read_unlock();
+		} else {
+			retval = scull_collect_range(0, max, &c);
+			if (retval) {
+				kvfree(buf);
+				return retval;
+			}
+			for (i = 0; i < c.n && i < max; i++)
+				scull_refresh_node(c.nodes[i], &buf[n++]);
+			overflow = c.overflow || c.n > max;
+			rcu_read_unlock();
+			kvfree(c.nodes);
+		}
+		if (!overflow)
+			break;
+		kvfree(buf);
+		max *= 2;
+	}
+
+	if (source == SCULL_Z_DUMP)
+		sort(buf, n, sizeof(*buf), scull_cmp_info_pid, NULL);
+	*recs = buf;
+	*nr = n;
 	return 0;
 }
 
+static int scull_zexport(struct scull_file *sf, struct scull_zexport *ex)
+{
+	struct scull_zprev *prev = NULL, *next = NULL;
+	unsigned long n, i, j = 0, nprev = 0;
+	unsigned long base_nv, base_niv;
+	struct task_info *recs = NULL;
+	pid_t last = 0;
+	u8 *out = NULL, *p;
+	int retval;
+
+	if (ex->source != SCULL_Z_DUMP && ex->source != SCULL_Z_REGISTRY)
+		return -EINVAL;
+
+	mutex_lock(&sf->read_lock);
+	retval = scull_zcollect(ex->source, &recs, &n);
+	if (retval)
+		goto out;
+	out = kvmalloc_array(n ? n : 1, SCULL_Z_RECORD_MAX, GFP_KERNEL);
+	next = kvmalloc_array(n ? n : 1, sizeof(*next), GFP_KERNEL);
+	if (!out || !next) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	if (!(ex->flags & SCULL_Z_KEYFRAME) && sf->zprev && sf->zprev_source == ex->source) {
+		prev = sf->zprev;
+		nprev = sf->zprev_n;
+	}
+	ex->flags = prev ? 0 : SCULL_Z_KEYFRAME;
+
+	p = out;
+	for (i = 0; i < n; i++) {
+		struct task_info *r = &recs[i];
+
+		while (j < nprev && prev[j].pid < r->pid)
+			j++;
+		if (j < nprev && prev[j].pid == r->pid) {
+			base_nv = prev[j].nvcsw;
+			base_niv = prev[j].nivcsw;
+		} else {
+			base_nv = base_niv = 0;
+		}
+		p = scull_put_varint(p, r->pid - last);
+		p = scull_put_varint(p, scull_zigzag(r->tgid - r->pid));
+		p = scull_put_varint(p, scull_zigzag(r->state));
+		p = scull_put_varint(p, r->cpu);
+		p = scull_put_varint(p, scull_zigzag(r->prio));
+		p = scull_put_varint(p, scull_zigzag(r->nvcsw - base_nv));
+		p = scull_put_varint(p, scull_zigzag(r->nivcsw - base_niv));
+		last = r->pid;
+		next[i].pid = r->pid;
+		next[i].nvcsw = r->nvcsw;
+		next[i].nivcsw = r->nivcsw;
+	}
+
+	/* Too small: report the size needed and keep the previous export */
+	if (p - out > ex->size) {
+		ex->size = p - out;
+		retval = -ENOSPC;
+		goto out;
+	}
+	if (copy_to_user((void __user *)ex->buf, out, p - out)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	ex->size = p - out;
+	ex->count = n;
+	swap(sf->zprev, next);
+	sf->zprev_n = n;
+	sf->zprev_source = ex->source;
+out:
+	mutex_unlock(&sf->read_lock);
+	kvfree(next);
+	kvfree(out);
+	kvfree(recs);
+	return retval;
+}
+
 /*
  * The ioctl() implementation
  */
@@ -132,42 +3669,263 @@ static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	
 	case SCULL_IOCIQUANTUM:
 		{
-			struct task_info_node *task_iter, *new_task_node; //Copy current struct info into temp struct
-			bool found = false;
-			tmp_struct.state = current->state;
-			tmp_struct.cpu = current->cpu;
-			tmp_struct.prio = current->prio;
-			tmp_struct.pid = current->pid;
-			tmp_struct.tgid = current->tgid;
-			tmp_struct.nvcsw = current->nvcsw;
-			tmp_struct.nivcsw = current->nivcsw;
+			struct task_info_node *new_task_node; //Copy current struct info into temp struct
+
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			scull_fill_info(&tmp_struct, current);
 
 			retval = copy_to_user((struct task_info *)arg, &tmp_struct, sizeof(tmp_struct)); //Update struct in user space
 			if (retval)
 				break;
 				
-			mutex_lock(&task_info_node_mutex);
-			list_for_each_entry(task_iter, &task_info_node_list, list) {
-				if (task_iter->pid == current->pid && task_iter->tgid == current->tgid) {
-					found = true;
-					break;
+			if (test_bit(current->pid, scull_pid_registered)) {
+				if (static_branch_likely(&scull_stats_key))
+					this_cpu_inc(scull_filter_hits);
+				scull_touch_pid(current->pid);
+
+				/* Keep the entry's snapshot as of the last call */
+				if (static_branch_likely(&scull_refresh_key)) {
+					rcu_read_lock();
+					new_task_node = scull_cached_lookup(current->pid, current->tgid);
+					if (new_task_node)
+						scull_node_set_info(new_task_node, &tmp_struct);
+					rcu_read_unlock();
 				}
+				break;
 			}
-			if (!found) {
-				new_task_node = kmalloc(sizeof(struct task_info_node), GFP_KERNEL);
-
-				if (!new_task_node) {
-					printk(KERN_ERR "Failed to allocate memory for task_info_node.\n");
-				} else {
-					new_task_node->pid = current->pid;
-					new_task_node->tgid = current->tgid;
-					list_add_tail(&new_task_node->list, &task_info_node_list);
+			if (static_branch_likely(&scull_stats_key))
+				this_cpu_inc(scull_filter_misses);
+			if (test_and_set_bit(current->pid, scull_pid_registered))
+				break;		/* raced with our own fork probe entry */
+
+			new_task_node = scull_alloc_node(current);
+
+			if (!new_task_node) {
+				clear_bit(current->pid, scull_pid_registered);
+				printk(KERN_ERR "Failed to allocate memory for task_info_node.\n");
+			} else if (scull_defer_insert) {
+				atomic_long_inc(&scull_deferred);
+				scull_defer_node(new_task_node);
+			} else {
+				scull_registry_insert(new_task_node);
+			}
+		}
+		break;
+
+	case SCULL_IOCTFOLLOW: /* Tell: arg is 1 to follow children, 0 to stop */
+		{
+			struct task_info_node *node;
+
+			if (!scull_feature_follow.enabled)
+				return -EOPNOTSUPP;
+			if (arg)
+				scull_pool_refill();
+
+			mutex_lock(&task_info_node_mutex);
+			node = scull_find_node(current->pid, current->tgid);
+			if (!node && arg) {
+				node = scull_alloc_node(current);
+				if (!node || scull_insert_node(node)) {
+					node = NULL;
+					retval = -ENOMEM;
 				}
 			}
-			mutex_unlock(&task_info_node_mutex);
+			if (node && arg) {
+				if (!test_and_set_bit(SCULL_NODE_FOLLOW, &node->flags))
+					atomic_inc(&scull_nr_followed);
+			} else if (node) {
+				if (test_and_clear_bit(SCULL_NODE_FOLLOW, &node->flags))
+					atomic_dec(&scull_nr_followed);
+			}
+			scull_registry_unlock();
+		}
+		break;
+
+
+	case SCULL_IOCSRATE: /* Set: arg points to a struct scull_rate */
+		{
+			struct scull_rate rate;
+
+			if (copy_from_user(&rate, (void __user *)arg, sizeof(rate)))
+				return -EFAULT;
+			scull_rate_set(filp->private_data, rate.rate, rate.burst);
+			if (rate.rate)
+				scull_feature_enable(&scull_feature_ratelimit);
+		}
+		break;
+
+	case SCULL_IOCGRATE: /* Get: arg points to a struct scull_rate */
+		{
+			struct scull_file *sf = filp->private_data;
+			struct scull_rate rate;
+
+			memset(&rate, 0, sizeof(rate));
+			spin_lock(&sf->rate_lock);
+			rate.rate = sf->rate;
+			rate.burst = sf->burst;
+			rate.throttled = sf->throttled;
+			spin_unlock(&sf->rate_lock);
+			if (copy_to_user((void __user *)arg, &rate, sizeof(rate)))
+				return -EFAULT;
+		}
+		break;
+
+	case SCULL_IOCRANGE: /* eXchange: arg points to a struct scull_range */
+		{
+			struct scull_range range;
+
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+				return -EFAULT;
+			retval = scull_read_range(&range);
+			if (retval == 0 && copy_to_user((void __user *)arg, &range, sizeof(range)))
+				retval = -EFAULT;
+		}
+		break;
+
+	case SCULL_IOCZEXPORT: /* eXchange: arg points to a struct scull_zexport */
+		{
+			struct scull_zexport ex;
+
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			if (copy_from_user(&ex, (void __user *)arg, sizeof(ex)))
+				return -EFAULT;
+			retval = scull_zexport(filp->private_data, &ex);
+			/* -ENOSPC also reports the size needed */
+			if ((retval == 0 || retval == -ENOSPC) &&
+			    copy_to_user((void __user *)arg, &ex, sizeof(ex)))
+				retval = -EFAULT;
+		}
+		break;
+
+	case SCULL_IOCSREAD: /* Set: arg is the SCULL_READ_* mode of read() */
+		if (arg != SCULL_READ_NONE && arg != SCULL_READ_DELTA && arg != SCULL_READ_SAMPLES)
+			return -EINVAL;
+		retval = scull_read_reset(filp->private_data, arg);
+		break;
+
+	case SCULL_IOCSUB: /* Set: arg points to a struct scull_sub */
+		{
+			struct scull_sub sub;
+
+			if (copy_from_user(&sub, (void __user *)arg, sizeof(sub)))
+				return -EFAULT;
+			retval = scull_sub_ioctl(filp->private_data, &sub);
+		}
+		break;
+
+	case SCULL_IOCRING: /* eXchange: arg points to a struct scull_ring_consumer */
+		{
+			struct scull_ring_consumer rc;
+
+			if (copy_from_user(&rc, (void __user *)arg, sizeof(rc)))
+				return -EFAULT;
+			retval = scull_ring_ioctl(filp->private_data, &rc);
+			if (retval == 0 && copy_to_user((void __user *)arg, &rc, sizeof(rc)))
+				retval = -EFAULT;
 		}
 		break;
 
+	case SCULL_IOCSINCE: /* eXchange: arg points to a struct scull_since */
+		{
+			struct scull_since since;
+
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			if (copy_from_user(&since, (void __user *)arg, sizeof(since)))
+				return -EFAULT;
+			retval = scull_read_since(&since);
+			if (retval == 0 && copy_to_user((void __user *)arg, &since, sizeof(since)))
+				retval = -EFAULT;
+		}
+		break;
+
+	case SCULL_IOCDUMP: /* eXchange: arg points to a struct scull_dump */
+		{
+			struct scull_dump dump;
+
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			if (copy_from_user(&dump, (void __user *)arg, sizeof(dump)))
+				return -EFAULT;
+			retval = scull_dump_tasks(&dump);
+			if (retval == 0 && copy_to_user((void __user *)arg, &dump, sizeof(dump)))
+				retval = -EFAULT;
+		}
+		break;
+
+	case SCULL_IOCCPUS: /* eXchange: arg points to a struct scull_cpus */
+		{
+			struct scull_cpus cpus;
+
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			if (copy_from_user(&cpus, (void __user *)arg, sizeof(cpus)))
+				return -EFAULT;
+			retval = scull_read_cpus(&cpus);
+			if (retval == 0 && copy_to_user((void __user *)arg, &cpus, sizeof(cpus)))
+				retval = -EFAULT;
+		}
+		break;
+
+	case SCULL_IOCWAKES: /* eXchange: arg points to a struct scull_wakes */
+		{
+			struct scull_wakes wakes;
+
+			if (!scull_feature_wakeup.enabled)
+				return -EOPNOTSUPP;
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			if (copy_from_user(&wakes, (void __user *)arg, sizeof(wakes)))
+				return -EFAULT;
+			retval = scull_read_wakes(&wakes);
+			if (retval == 0 && copy_to_user((void __user *)arg, &wakes, sizeof(wakes)))
+				retval = -EFAULT;
+		}
+		break;
+
+	case SCULL_IOCALERT: /* Set: arg points to a struct scull_alert */
+		{
+			struct scull_alert alert;
+
+			if (copy_from_user(&alert, (void __user *)arg, sizeof(alert)))
+				return -EFAULT;
+			retval = scull_alert_add(filp, &alert);
+		}
+		break;
+
+	case SCULL_IOCWATCH: /* returns a poll()able fd of struct scull_stuck */
+		retval = scull_watch_open(filp->private_data);
+		break;
+
+	case SCULL_IOCOFFCPU: /* eXchange: arg points to a struct scull_offcpu */
+		{
+			struct scull_offcpu off;
+
+			if (!scull_feature_offcpu.enabled)
+				return -EOPNOTSUPP;
+			if (!capable(CAP_SYSLOG))	/* kernel text addresses */
+				return -EPERM;
+			retval = scull_rate_check(filp);
+			if (retval)
+				break;
+			if (copy_from_user(&off, (void __user *)arg, sizeof(off)))
+				return -EFAULT;
+			retval = scull_read_offcpu(&off);
+			if (retval == 0 && copy_to_user((void __user *)arg, &off, sizeof(off)))
+				retval = -EFAULT;
+		}
+		break;
 
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -177,7 +3935,11 @@ static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
+	.read_iter = scull_read_iter,
+	.splice_read = generic_file_splice_read,
+	.poll =     scull_poll,
 	.unlocked_ioctl = scull_ioctl,
+	.mmap =     scull_mmap,
 	.open =     scull_open,
 	.release =  scull_release,
 };
@@ -186,6 +3948,16 @@ struct file_operations scull_fops = {
  * Finally, the module stuff
  */
 
+static bool scull_release_node(struct task_info_node *node, void *arg)
+{
+    int *count = arg;
+
+    printk(KERN_INFO "Task %d: PID %d, TGID %d\n", *count, node->pid, node->tgid); //Printing out registry
+    scull_delete_node(node);
+    (*count)++;
+    return true;
+}
+
 /*
  * The cleanup function is used to handle initialization failures as well.
  * Thefore, it must be careful to work correctly even if some of the items
@@ -195,17 +3967,59 @@ void scull_cleanup_module(void)
 {
     dev_t devno = MKDEV(scull_major, scull_minor);
     struct task_info_node *node, *temp_node;
-    int count = 1;
-
-    // Print and free the linked list
-    mutex_lock(&task_info_node_mutex);
-    list_for_each_entry_safe(node, temp_node, &task_info_node_list, list) {
-        printk(KERN_INFO "Task %d: PID %d, TGID %d\n", count, node->pid, node->tgid); //Printing out linked list 
-        list_del(&node->list);
-        kfree(node);
-        count++;
+    struct llist_node *batch;
+    struct scull_cgroup_count *cc;
+    struct hlist_node *htmp;
+    int count = 1, bkt;
+
+    debugfs_remove_recursive(scull_debugfs_dir);
+
+    // Stop the fork probe and the shrinker before tearing down what they use
+    unregister_shrinker(&scull_shrinker);
+    scull_unregister_tracepoints();
+    cancel_work_sync(&scull_insert_work);
+    cancel_work_sync(&scull_exit_detach_work);
+    cancel_delayed_work_sync(&scull_watch_work);	/* watch fds pin the module */
+    cancel_delayed_work_sync(&scull_sample_work);	/* and so do sampler users */
+
+    batch = llist_del_all(&scull_pending_nodes);
+    llist_for_each_entry_safe(node, temp_node, batch, pending)
+        kmem_cache_free(scull_node_cache, node);
+    list_for_each_entry_safe(node, temp_node, &scull_node_pool, list)
+        kmem_cache_free(scull_node_cache, node);
+    INIT_LIST_HEAD(&scull_node_pool);
+    scull_node_pool_count = 0;
+    if (atomic_long_read(&scull_follow_dropped))
+        printk(KERN_INFO "scull: %ld forks not followed (pool empty)\n",
+               atomic_long_read(&scull_follow_dropped));
+
+    // Print and free the registry
+    if (scull_ops) {
+        mutex_lock(&task_info_node_mutex);
+        rcu_read_lock();
+        scull_ops->walk(0, scull_release_node, &count);
+        rcu_read_unlock();
+        mutex_unlock(&task_info_node_mutex);
+    }
+    cancel_work_sync(&scull_exit_detach_work);	/* queued by the last delete */
+    hash_for_each_safe(scull_cgroup_counts, bkt, htmp, cc, hash) {
+        hash_del(&cc->hash);
+        kfree(cc);
     }
-    mutex_unlock(&task_info_node_mutex);
+
+    // Wait for nodes handed to call_rcu()
+    rcu_barrier();
+    if (scull_ops && scull_ops->destroy)
+        scull_ops->destroy();
+    vfree(scull_pid_registered);
+    vfree(scull_pid_referenced);
+    vfree(scull_switch_rings);
+    vfree(scull_wake_table);
+    vfree(scull_offcpu_table);
+    vfree(scull_stack_table);
+    vfree(scull_tombs);
+    scull_sample_ring_free();
+    kmem_cache_destroy(scull_node_cache);
 
     // Get rid of the char dev entry
     cdev_del(&scull_cdev);
@@ -218,9 +4032,34 @@ void scull_cleanup_module(void)
 
 int scull_init_module(void)
 {
-	int result;
+	int result, i;
 	dev_t dev = 0;
 
+	for (i = 0; i < ARRAY_SIZE(scull_backends); i++) {
+		if (!strcmp(scull_backend, scull_backends[i]->name))
+			scull_ops = scull_backends[i];
+	}
+	if (!scull_ops) {
+		printk(KERN_WARNING "scull: unknown backend %s\n", scull_backend);
+		return -EINVAL;
+	}
+	if (scull_ops->init) {
+		result = scull_ops->init();
+		if (result)
+			return result;
+	}
+
+	scull_node_cache = KMEM_CACHE(task_info_node, SLAB_ACCOUNT);
+	scull_pid_registered = vzalloc(BITS_TO_LONGS(PID_MAX_LIMIT) * sizeof(long));
+	scull_pid_referenced = vzalloc(BITS_TO_LONGS(PID_MAX_LIMIT) * sizeof(long));
+	if (!scull_node_cache || !scull_pid_registered || !scull_pid_referenced ||
+	    scull_switch_rings_init() || scull_wake_table_init() ||
+	    scull_offcpu_table_init() || scull_tombs_init() ||
+	    scull_sample_ring_init()) {
+		result = -ENOMEM;
+		goto fail_alloc;
+	}
+
 	/*
 	 * Get a range of minor numbers to work with, asking for a dynamic
 	 * major unless directed otherwise at load time.
@@ -234,7 +4073,7 @@ int scull_init_module(void)
 	}
 	if (result < 0) {
 		printk(KERN_WARNING "scull: can't get major %d\n", scull_major);
-		return result;
+		goto fail_alloc;
 	}
 
 	cdev_init(&scull_cdev, &scull_fops);
@@ -246,11 +4085,35 @@ int scull_init_module(void)
 		goto fail;
 	}
 
+	result = register_shrinker(&scull_shrinker);
+	if (result) {
+		printk(KERN_NOTICE "scull: can't register shrinker\n");
+		goto fail;
+	}
+
+	scull_find_tracepoints();
+	scull_features_init();
+	scull_debugfs_init();
+
 	return 0; /* succeed */
 
   fail:
 	scull_cleanup_module();
 	return result;
+
+  fail_alloc:
+	vfree(scull_pid_registered);
+	vfree(scull_pid_referenced);
+	vfree(scull_switch_rings);
+	vfree(scull_wake_table);
+	vfree(scull_offcpu_table);
+	vfree(scull_stack_table);
+	vfree(scull_tombs);
+	scull_sample_ring_free();
+	kmem_cache_destroy(scull_node_cache);
+	if (scull_ops->destroy)
+		scull_ops->destroy();
+	return result;
 }
 
 module_init(scull_init_module);
@@ -34,6 +34,291 @@ struct task_info{
     unsigned long nivcsw;
 };
 
+/* Per-open rate limit of the snapshot ioctls */
+struct scull_rate {
+    unsigned int rate;		/* calls per second, 0 = unlimited */
+    unsigned int burst;
+    unsigned long throttled;	/* Get only: calls delayed or refused */
+};
+
+/*
+ * Paged read of the registry in pid order. Fill in start (0 the first
+ * time), count and entries; on return count holds the number of entries
+ * written and next the start of the following page, or 0 at the end.
+ */
+struct scull_range {
+    pid_t start;
+    pid_t next;
+    unsigned int count;
+    struct task_info *entries;
+};
+
+#define SCULL_RANGE_MAX 4096	/* entries per call */
+
+/*
+ * Snapshot of every thread on the system. count is the capacity of
+ * entries on the way in and the number written on the way out; total is
+ * the number of threads seen, which may exceed count.
+ */
+struct scull_dump {
+    unsigned int count;
+    unsigned int total;
+    struct task_info *entries;
+};
+
+#define SCULL_DUMP_MAX (1 << 20)	/* entries per call */
+
+/* Per-CPU runqueue snapshot, one record per online CPU */
+struct scull_cpu_info {
+    unsigned int cpu;
+    pid_t curr;			/* running pid, 0 when idle */
+    unsigned int nr_running;	/* runnable threads last on this CPU */
+    unsigned long nr_switches;	/* context switches seen by the driver */
+};
+
+struct scull_cpus {
+    unsigned int count;		/* capacity in, records written out */
+    struct scull_cpu_info *entries;
+};
+
+/*
+ * Waker->wakee edges among registered tasks: how many wakeups, and the
+ * summed latency from sched_waking until the wakee ran. total is the number
+ * of edges recorded, dropped the edges lost to a full table. With
+ * SCULL_TABLE_CLEAR in flags the table and dropped start over once read.
+ */
+#define SCULL_TABLE_CLEAR	1
+
+struct scull_wake_edge {
+    pid_t waker;
+    pid_t wakee;
+    unsigned long count;
+    unsigned long long lat_ns;
+};
+
+struct scull_wakes {
+    unsigned int count;		/* capacity in, records written out */
+    unsigned int total;
+    unsigned int flags;
+    unsigned int pad;
+    unsigned long dropped;
+    struct scull_wake_edge *entries;
+};
+
+/*
+ * Off-CPU time of registered tasks, per (pid, kernel stack they blocked
+ * in). ips[0] is the innermost frame; nr is 0 when the stack could not be
+ * saved. Reading it needs CAP_SYSLOG; SCULL_TABLE_CLEAR in flags empties
+ * the tables and dropped once read, as for SCULL_IOCWAKES.
+ */
+#define SCULL_STACK_MAX 32
+
+struct scull_offcpu_stack {
+    pid_t pid;
+    unsigned int nr;
+    unsigned long count;	/* times blocked there */
+    unsigned long long off_ns;	/* total time off CPU */
+    unsigned long ips[SCULL_STACK_MAX];
+};
+
+struct scull_offcpu {
+    unsigned int count;		/* capacity in, records written out */
+    unsigned int total;
+    unsigned int flags;
+    unsigned int pad;
+    unsigned long dropped;
+    struct scull_offcpu_stack *entries;
+};
+
+/*
+ * Read from the fd SCULL_IOCWATCH returns: one record per registered task
+ * whose switch counts have not moved for scull_stuck_ms while running
+ * (state 0) or in an uninterruptible sleep (state & 2, e.g.
+ * TASK_KILLABLE) other than TASK_IDLE. state is the raw task state.
+ */
+struct scull_stuck {
+    pid_t pid;
+    pid_t tgid;
+    long state;
+    unsigned long nvcsw;
+    unsigned long nivcsw;
+    unsigned int stuck_ms;
+    unsigned int pad;
+};
+
+/*
+ * Threshold alert: the driver signals efd (an eventfd) when, over one
+ * sampling period, the per-second rate of kind on tgid's registered tasks
+ * goes above threshold. It signals again only after the rate has dropped
+ * back. Rules last until the scull fd that set them is closed.
+ */
+#define SCULL_ALERT_NIVCSW	1	/* involuntary switches, summed over tgid */
+#define SCULL_ALERT_MIGRATIONS	2	/* CPU migrations of any one task of tgid */
+
+struct scull_alert {
+    int efd;
+    unsigned int kind;
+    pid_t tgid;
+    unsigned int threshold;	/* per second */
+};
+
+/*
+ * Incremental sync. Pass gen 0 the first time for every live entry, then
+ * the gen returned: entries inserted or changed since come back with
+ * their snapshot, deleted ones as tombstones (deleted set, only pid and
+ * tgid valid), oldest first. With SCULL_SINCE_MORE set there is more to
+ * read right away; with SCULL_SINCE_RESYNC the deletes since gen are no
+ * longer all known, so start over from 0.
+ */
+#define SCULL_SINCE_MAX 65536	/* entries per call */
+#define SCULL_SINCE_MORE	1
+#define SCULL_SINCE_RESYNC	2
+
+struct scull_change {
+    unsigned long long gen;
+    unsigned int deleted;
+    unsigned int pad;
+    struct task_info info;
+};
+
+struct scull_since {
+    unsigned long long gen;	/* last seen in, resume point out */
+    unsigned int count;		/* capacity in, records written out */
+    unsigned int flags;
+    struct scull_change *entries;
+};
+
+/*
+ * What read() on the device returns, per fd (SCULL_IOCSREAD). In
+ * SCULL_READ_DELTA mode, struct task_info records, in pid order, for just
+ * the registered tasks whose record changed since this fd last got one;
+ * a read of 0 ends a pass and the next read starts another.
+ */
+#define SCULL_READ_NONE		0
+#define SCULL_READ_DELTA	1
+#define SCULL_READ_SAMPLES	2	/* struct scull_sample records, see below */
+
+/*
+ * Compressed export of every thread (SCULL_Z_DUMP) or of the registry
+ * (SCULL_Z_REGISTRY). size is the capacity of buf on the way in and the
+ * bytes written on the way out; on ENOSPC it is the size needed. buf holds
+ * count records in increasing pid order, each seven LEB128 varints:
+ *
+ *	pid - previous record's pid (0 for the first)
+ *	zigzag(tgid - pid)
+ *	zigzag(state)
+ *	cpu
+ *	zigzag(prio)
+ *	zigzag(nvcsw - base nvcsw)
+ *	zigzag(nivcsw - base nivcsw)
+ *
+ * where base is the same pid's record in the previous export from this fd
+ * and source, or 0 if there is none. SCULL_Z_KEYFRAME comes back set when
+ * nothing was encoded against a previous export; setting it on the way in
+ * asks for that (e.g. after a lost export). See src/scull_decode.c.
+ */
+#define SCULL_Z_DUMP		0
+#define SCULL_Z_REGISTRY	1
+#define SCULL_Z_KEYFRAME	1
+#define SCULL_Z_RECORD_MAX	50	/* bytes per record, at most */
+
+struct scull_zexport {
+    unsigned int source;
+    unsigned int flags;
+    unsigned int count;
+    unsigned int size;
+    unsigned char *buf;
+};
+
+/*
+ * Per-fd subscription set: once it holds any pid or tgid, read() and
+ * poll() on that fd (delta and sample streams) only report tasks whose pid
+ * or tgid is in it, and a watch fd created from it (SCULL_IOCWATCH) only
+ * reports those tasks, per the set as it was then. ADD and DEL take count
+ * ids of one kind and apply all of them or, on error, none; CLEAR empties
+ * both kinds.
+ */
+#define SCULL_SUB_MAX	65536	/* ids per call */
+#define SCULL_SUB_ADD	0
+#define SCULL_SUB_DEL	1
+#define SCULL_SUB_CLEAR	2
+#define SCULL_SUB_PID	0
+#define SCULL_SUB_TGID	1
+
+struct scull_sub {
+    unsigned int op;
+    unsigned int kind;
+    unsigned int count;
+    unsigned int pad;
+    pid_t *ids;
+};
+
+/*
+ * mmap offsets. At SCULL_MMAP_SWITCH_OFF there is one page-aligned ring per
+ * possible CPU (size: sysconf(_SC_NPROCESSORS_CONF) rings, each rounded up
+ * to the page size) holding the last nr times a registered task ran there.
+ * head counts records ever written; the newest is recs[(head - 1) % nr].
+ */
+#define SCULL_MMAP_SWITCH_OFF	0
+#define SCULL_MMAP_SAMPLES_OFF	0x40000000
+
+struct scull_switch_rec {
+    pid_t pid;
+    unsigned int pad;
+    unsigned long long in_ns;	/* CLOCK_MONOTONIC */
+    unsigned long long out_ns;
+};
+
+struct scull_switch_ring {
+    unsigned long long head;
+    unsigned int nr;
+    unsigned int cpu;
+    struct scull_switch_rec recs[];
+};
+
+/*
+ * At SCULL_MMAP_SAMPLES_OFF: this header page, then nr records of size
+ * bytes starting data_off bytes into the mapping. Every sampler period
+ * appends one record per live registered task, all with the same seq.
+ * head counts records ever written; the newest is at (head - 1) % nr.
+ * Mapping the ring keeps the sampler running.
+ */
+struct scull_sample {
+    unsigned long long ts_ns;	/* CLOCK_MONOTONIC */
+    unsigned long long seq;	/* sampler period */
+    struct task_info info;
+    unsigned long long pad;
+};
+
+struct scull_sample_ring {
+    unsigned long long head;
+    unsigned long long nr;
+    unsigned int size;
+    unsigned int data_off;
+    unsigned long long dropped;	/* held back by a drop consumer */
+};
+
+/*
+ * Reading the sample ring with read() (SCULL_READ_SAMPLES) instead: each
+ * fd has its own cursor, starting at the newest record. SCULL_IOCRING
+ * attaches the fd (or changes its policy) and reports head, the fd's tail
+ * and how many records it lost. An overwrite consumer that falls a whole
+ * ring behind skips ahead; a drop consumer stops the driver from writing
+ * over what it has not read yet, at the cost of new samples for everyone.
+ * read() blocks until there is a record unless the fd is O_NONBLOCK;
+ * poll() reports when there is.
+ */
+#define SCULL_RING_OVERWRITE	0
+#define SCULL_RING_DROP		1
+
+struct scull_ring_consumer {
+    unsigned int policy;
+    unsigned int pad;
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long long lost;
+};
+
 /*
  * SCULL_QUANTUM
  */
@@ -65,9 +350,24 @@ struct task_info{
 #define SCULL_IOCXQUANTUM _IOWR(SCULL_IOC_MAGIC, 5, int)
 #define SCULL_IOCHQUANTUM _IO(SCULL_IOC_MAGIC,   6)
 #define SCULL_IOCIQUANTUM _IOR(SCULL_IOC_MAGIC, 7, struct task_info)
+#define SCULL_IOCTFOLLOW  _IO(SCULL_IOC_MAGIC,   8)
+#define SCULL_IOCSRATE    _IOW(SCULL_IOC_MAGIC,  9, struct scull_rate)
+#define SCULL_IOCGRATE    _IOR(SCULL_IOC_MAGIC, 10, struct scull_rate)
+#define SCULL_IOCRANGE    _IOWR(SCULL_IOC_MAGIC, 11, struct scull_range)
+#define SCULL_IOCDUMP     _IOWR(SCULL_IOC_MAGIC, 12, struct scull_dump)
+#define SCULL_IOCCPUS     _IOWR(SCULL_IOC_MAGIC, 13, struct scull_cpus)
+#define SCULL_IOCWAKES    _IOWR(SCULL_IOC_MAGIC, 14, struct scull_wakes)
+#define SCULL_IOCOFFCPU   _IOWR(SCULL_IOC_MAGIC, 15, struct scull_offcpu)
+#define SCULL_IOCWATCH    _IO(SCULL_IOC_MAGIC,   16)
+#define SCULL_IOCALERT    _IOW(SCULL_IOC_MAGIC,  17, struct scull_alert)
+#define SCULL_IOCSINCE    _IOWR(SCULL_IOC_MAGIC, 18, struct scull_since)
+#define SCULL_IOCSREAD    _IO(SCULL_IOC_MAGIC,   19)
+#define SCULL_IOCZEXPORT  _IOWR(SCULL_IOC_MAGIC, 20, struct scull_zexport)
+#define SCULL_IOCRING     _IOWR(SCULL_IOC_MAGIC, 21, struct scull_ring_consumer)
+#define SCULL_IOCSUB      _IOW(SCULL_IOC_MAGIC,  22, struct scull_sub)
 
 /* Do not forget to modify this macro if you add new commands! */
-#define SCULL_IOC_MAXNR 7
+#define SCULL_IOC_MAXNR 22
 
 #endif /* _SCULL_H_ */
 
@@ -1,14 +1,20 @@
+#define _GNU_SOURCE	/* splice() */
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/wait.h>
 #include <pthread.h>
 
 #include "scull.h"
+#include "scull_decode.h"
 
 #define CDEV_NAME "/dev/scull"
 #define NUM_CHILDREN 4
@@ -31,6 +37,23 @@ static void usage(const char *cmd)
 	       "  H <int>    Shift quantum\n"
 	       "  h          Print this message\n"
 		   "  I			 Info of current Process\n"
+		   "  f          Follow: register forked children automatically\n"
+		   "  l          List the registry, one page at a time\n"
+		   "  d          Dump every thread on the system\n"
+		   "  c          Per-CPU runqueue snapshot (needs scull_feature_cpustat)\n"
+		   "  w          Wakeup edges among registered tasks (needs scull_feature_wakeup)\n"
+		   "  o          Off-CPU time per kernel stack (needs scull_feature_offcpu)\n"
+		   "  A <int>    Alert when this process exceeds <int> involuntary switches/s\n"
+		   "  g          Sync the registry incrementally, twice, a second apart\n"
+		   "  v          Read changed registry entries only, two passes a second apart\n"
+		   "  u          Like v, but subscribed to this process's threads only\n"
+		   "  z          Compressed dump of every thread, twice, a second apart\n"
+		   "  y          Splice one delta pass into ./scull.delta\n"
+		   "  m          Map the sample ring, wait two seconds, print the newest samples\n"
+		   "  k <int>    Consume the sample ring with read() for five seconds (policy 0 or 1)\n"
+		   "  W          Watch for stuck registered tasks until interrupted\n"
+		   "  r          Recent registered tasks per CPU (needs scull_feature_history)\n"
+		   "  L <int>    Rate limit Info calls on this fd, then call it in a loop\n"
 		   ,
 	       cmd);
 }
@@ -76,6 +99,9 @@ static cmd_t parse_arguments(int argc, const char **argv)
 	case 'T':
 	case 'H':
 	case 'X':
+	case 'L':
+	case 'A':
+	case 'k':
 		if (argc < 3) {
 			fprintf(stderr, "%s: Missing quantum\n", argv[0]);
 			cmd = -1;
@@ -91,6 +117,20 @@ static cmd_t parse_arguments(int argc, const char **argv)
 	case 'P':
 	case 'p':
 	case 't':
+	case 'f':
+	case 'l':
+	case 'd':
+	case 'c':
+	case 'r':
+	case 'w':
+	case 'o':
+	case 'W':
+	case 'g':
+	case 'v':
+	case 'u':
+	case 'z':
+	case 'y':
+	case 'm':
 		break;
 	default:
 		fprintf(stderr, "%s: Invalid command\n", argv[0]);
@@ -195,6 +235,381 @@ static int do_op(int fd, cmd_t cmd)
 			ret = 0;
 			break;
 		}
+	case 'l':
+		{
+			static struct task_info page[64];
+			struct scull_range range = { .start = 0 };
+			do {
+				range.count = 64;
+				range.entries = page;
+				ret = ioctl(fd, SCULL_IOCRANGE, &range);
+				if (ret != 0)
+					break;
+				for (unsigned int i = 0; i < range.count; i++) {
+					printf("state %ld, cpu %u, prio %d, pid %i, tgid %i, nv %lu, niv %lu\n",
+					       page[i].state, page[i].cpu, page[i].prio, page[i].pid,
+					       page[i].tgid, page[i].nvcsw, page[i].nivcsw);
+				}
+				range.start = range.next;
+			} while (range.next);
+			break;
+		}
+	case 'd':
+		{
+			struct scull_dump dump = { .count = 4096 };
+			struct task_info *entries = NULL;
+			do { /* grow the buffer until every thread fits */
+				dump.count = dump.total > dump.count ? dump.total + 256 : dump.count;
+				free(entries);
+				entries = malloc(dump.count * sizeof(*entries));
+				if (!entries) {
+					perror("malloc");
+					return -1;
+				}
+				dump.entries = entries;
+				ret = ioctl(fd, SCULL_IOCDUMP, &dump);
+			} while (ret == 0 && dump.total > dump.count);
+			for (unsigned int i = 0; ret == 0 && i < dump.count; i++) {
+				printf("state %ld, cpu %u, prio %d, pid %i, tgid %i, nv %lu, niv %lu\n",
+				       entries[i].state, entries[i].cpu, entries[i].prio, entries[i].pid,
+				       entries[i].tgid, entries[i].nvcsw, entries[i].nivcsw);
+			}
+			free(entries);
+			break;
+		}
+	case 'c':
+		{
+			static struct scull_cpu_info cpus[1024];
+			struct scull_cpus req = { .count = 1024, .entries = cpus };
+			ret = ioctl(fd, SCULL_IOCCPUS, &req);
+			for (unsigned int i = 0; ret == 0 && i < req.count; i++) {
+				printf("cpu %u, curr %i, running %u, switches %lu\n",
+				       cpus[i].cpu, cpus[i].curr, cpus[i].nr_running, cpus[i].nr_switches);
+			}
+			break;
+		}
+	case 'w':
+		{
+			static struct scull_wake_edge edges[4096];
+			struct scull_wakes req = { .count = 4096, .entries = edges };
+			ret = ioctl(fd, SCULL_IOCWAKES, &req);
+			for (unsigned int i = 0; ret == 0 && i < req.count; i++) {
+				printf("%i -> %i, wakeups %lu, avg latency %llu ns\n",
+				       edges[i].waker, edges[i].wakee, edges[i].count,
+				       edges[i].lat_ns / (edges[i].count ? edges[i].count : 1));
+			}
+			if (ret == 0)
+				printf("edges %u, dropped %lu\n", req.total, req.dropped);
+			break;
+		}
+	case 'o':
+		{ /* One folded line per stack, outermost frame first */
+			static struct scull_offcpu_stack stacks[1024];
+			struct scull_offcpu req = { .count = 1024, .entries = stacks };
+			ret = ioctl(fd, SCULL_IOCOFFCPU, &req);
+			for (unsigned int i = 0; ret == 0 && i < req.count; i++) {
+				printf("%i", stacks[i].pid);
+				for (unsigned int j = stacks[i].nr; j > 0; j--)
+					printf(";%#lx", stacks[i].ips[j - 1]);
+				printf(" %llu\n", stacks[i].off_ns / 1000);
+			}
+			break;
+		}
+	case 'A':
+		{ /* The caller registers itself, then waits up to a minute */
+			struct scull_alert alert = {
+				.kind = SCULL_ALERT_NIVCSW,
+				.tgid = getpid(),
+				.threshold = g_quantum,
+			};
+			struct pollfd pfd = { .events = POLLIN };
+			uint64_t fired;
+
+			ret = ioctl(fd, SCULL_IOCIQUANTUM, &tmp);
+			if (ret != 0)
+				break;
+			alert.efd = pfd.fd = eventfd(0, 0);
+			ret = ioctl(fd, SCULL_IOCALERT, &alert);
+			if (ret != 0)
+				break;
+			if (poll(&pfd, 1, 60000) > 0 && read(pfd.fd, &fired, sizeof(fired)) == sizeof(fired))
+				printf("alert fired %llu times\n", (unsigned long long)fired);
+			else
+				printf("no alert\n");
+			close(pfd.fd);
+			break;
+		}
+	case 'g':
+		{ /* Second round only reports what changed during the sleep */
+			static struct scull_change changes[4096];
+			struct scull_since req = { .gen = 0 };
+			for (int round = 0; round < 2; round++) {
+				unsigned int live = 0, dead = 0;
+				do {
+					req.count = 4096;
+					req.entries = changes;
+					ret = ioctl(fd, SCULL_IOCSINCE, &req);
+					if (ret != 0)
+						break;
+					if (req.flags & SCULL_SINCE_RESYNC) {
+						req.gen = 0;
+						continue;
+					}
+					for (unsigned int i = 0; i < req.count; i++) {
+						if (changes[i].deleted)
+							dead++;
+						else
+							live++;
+					}
+				} while (req.flags & (SCULL_SINCE_MORE | SCULL_SINCE_RESYNC));
+				if (ret != 0)
+					break;
+				printf("gen %llu: %u changed, %u deleted\n", req.gen, live, dead);
+				sleep(1);
+			}
+			break;
+		}
+	case 'u':
+		{
+			pid_t self = getpid();
+			struct scull_sub sub = {
+				.op = SCULL_SUB_ADD, .kind = SCULL_SUB_TGID, .count = 1, .ids = &self,
+			};
+
+			ret = ioctl(fd, SCULL_IOCSUB, &sub);
+			if (ret != 0)
+				break;
+		}
+		/* fall through */
+	case 'v':
+		{
+			static struct task_info recs[1024];
+			ssize_t n;
+
+			ret = ioctl(fd, SCULL_IOCSREAD, SCULL_READ_DELTA);
+			if (ret != 0)
+				break;
+			for (int pass = 0; pass < 2; pass++) {
+				unsigned long total = 0;
+				while ((n = read(fd, recs, sizeof(recs))) > 0) {
+					for (ssize_t i = 0; i < n / (ssize_t)sizeof(recs[0]); i++) {
+						printf("state %ld, cpu %u, prio %d, pid %i, tgid %i, nv %lu, niv %lu\n",
+						       recs[i].state, recs[i].cpu, recs[i].prio, recs[i].pid,
+						       recs[i].tgid, recs[i].nvcsw, recs[i].nivcsw);
+					}
+					total += n / sizeof(recs[0]);
+				}
+				if (n < 0) {
+					ret = -1;
+					break;
+				}
+				printf("pass %d: %lu changed\n", pass, total);
+				sleep(1);
+			}
+			break;
+		}
+	case 'z':
+		{ /* The second export only carries counter deltas */
+			struct scull_zmirror mirror = { .recs = NULL };
+			struct scull_zexport ex = { .source = SCULL_Z_DUMP };
+			static unsigned char zbuf[1 << 22];
+			static struct task_info recs[(1 << 22) / 7];
+			for (int round = 0; round < 2; round++) {
+				ex.flags = 0;
+				ex.size = sizeof(zbuf);
+				ex.buf = zbuf;
+				ret = ioctl(fd, SCULL_IOCZEXPORT, &ex);
+				if (ret != 0)
+					break;
+				if (scull_zdecode(&mirror, &ex, recs) != 0) {
+					fprintf(stderr, "corrupt export\n");
+					break;
+				}
+				printf("%u threads in %u bytes (%zu raw)%s\n", ex.count, ex.size,
+				       ex.count * sizeof(struct task_info),
+				       (ex.flags & SCULL_Z_KEYFRAME) ? ", keyframe" : "");
+				sleep(1);
+			}
+			scull_zmirror_free(&mirror);
+			break;
+		}
+	case 'y':
+		{ /* Driver -> pipe -> file, never through this process */
+			int pipefd[2], out;
+			ssize_t n, total = 0;
+
+			ret = ioctl(fd, SCULL_IOCSREAD, SCULL_READ_DELTA);
+			if (ret != 0)
+				break;
+			out = open("scull.delta", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (out < 0 || pipe(pipefd) != 0) {
+				ret = -1;
+				break;
+			}
+			while ((n = splice(fd, NULL, pipefd[1], NULL, 1 << 16, 0)) > 0) {
+				while (n > 0) {
+					ssize_t m = splice(pipefd[0], NULL, out, NULL, n, 0);
+					if (m <= 0)
+						break;
+					n -= m;
+					total += m;
+				}
+			}
+			ret = n < 0 ? -1 : 0;
+			printf("%zd bytes, %zu records\n", total, total / sizeof(struct task_info));
+			close(pipefd[0]);
+			close(pipefd[1]);
+			close(out);
+			break;
+		}
+	case 'm':
+		{ /* Header page first, to learn the ring size */
+			long page = sysconf(_SC_PAGESIZE);
+			struct scull_sample_ring *ring;
+			struct scull_sample *recs;
+			unsigned long long head;
+			size_t size;
+
+			ring = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, SCULL_MMAP_SAMPLES_OFF);
+			if (ring == MAP_FAILED) {
+				ret = -1;
+				break;
+			}
+			size = ring->data_off + ring->nr * ring->size;
+			munmap(ring, page);
+			ring = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, SCULL_MMAP_SAMPLES_OFF);
+			if (ring == MAP_FAILED) {
+				ret = -1;
+				break;
+			}
+			recs = (struct scull_sample *)((char *)ring + ring->data_off);
+			sleep(2);
+			head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			for (unsigned long long i = head > 8 ? head - 8 : 0; i < head; i++) {
+				struct scull_sample *r = &recs[i % ring->nr];
+				printf("seq %llu, ts %llu, pid %i, state %ld, cpu %u, nv %lu, niv %lu\n",
+				       r->seq, r->ts_ns, r->info.pid, r->info.state, r->info.cpu,
+				       r->info.nvcsw, r->info.nivcsw);
+			}
+			printf("%llu samples written\n", head);
+			munmap(ring, size);
+			ret = 0;
+			break;
+		}
+	case 'k':
+		{ /* Run one with 0 and one with 1 side by side to compare */
+			struct scull_ring_consumer rc = { .policy = g_quantum };
+			static struct scull_sample samples[4096];
+			unsigned long long got = 0;
+			time_t end = time(NULL) + 5;
+			ssize_t n;
+
+			ret = ioctl(fd, SCULL_IOCRING, &rc);
+			if (ret != 0)
+				break;
+			while (time(NULL) < end && (n = read(fd, samples, sizeof(samples))) > 0)
+				got += n / sizeof(samples[0]);
+			ret = ioctl(fd, SCULL_IOCRING, &rc);
+			if (ret == 0)
+				printf("read %llu, lost %llu, tail %llu, head %llu\n",
+				       got, rc.lost, rc.tail, rc.head);
+			break;
+		}
+	case 'W':
+		{
+			struct pollfd pfd = { .events = POLLIN };
+			struct scull_stuck ev[16];
+			ssize_t n;
+
+			pfd.fd = ioctl(fd, SCULL_IOCWATCH);
+			if (pfd.fd < 0) {
+				ret = -1;
+				break;
+			}
+			while (poll(&pfd, 1, -1) > 0) {
+				n = read(pfd.fd, ev, sizeof(ev));
+				for (ssize_t i = 0; i < n / (ssize_t)sizeof(ev[0]); i++) {
+					printf("stuck: pid %i, tgid %i, state %ld, nv %lu, niv %lu, for %u ms\n",
+					       ev[i].pid, ev[i].tgid, ev[i].state, ev[i].nvcsw,
+					       ev[i].nivcsw, ev[i].stuck_ms);
+				}
+			}
+			close(pfd.fd);
+			ret = 0;
+			break;
+		}
+	case 'r':
+		{ /* Map one ring to learn its size, then all of them */
+			long page = sysconf(_SC_PAGESIZE);
+			long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+			struct scull_switch_ring *ring;
+			size_t size;
+			char *map;
+
+			ring = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, SCULL_MMAP_SWITCH_OFF);
+			if (ring == MAP_FAILED) {
+				ret = -1;
+				break;
+			}
+			size = sizeof(*ring) + ring->nr * sizeof(ring->recs[0]);
+			size = (size + page - 1) / page * page;
+			munmap(ring, page);
+			map = mmap(NULL, size * ncpus, PROT_READ, MAP_SHARED, fd, SCULL_MMAP_SWITCH_OFF);
+			if (map == MAP_FAILED) {
+				ret = -1;
+				break;
+			}
+			for (long cpu = 0; cpu < ncpus; cpu++) {
+				unsigned long long head;
+
+				ring = (struct scull_switch_ring *)(map + cpu * size);
+				head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+				for (unsigned long long i = head > 8 ? head - 8 : 0; i < head; i++) {
+					struct scull_switch_rec *rec = &ring->recs[i % ring->nr];
+					printf("cpu %u, pid %i, in %llu, ran %llu ns\n",
+					       ring->cpu, rec->pid, rec->in_ns, rec->out_ns - rec->in_ns);
+				}
+			}
+			munmap(map, size * ncpus);
+			ret = 0;
+			break;
+		}
+	case 'L':
+		{
+			struct scull_rate rate = { .rate = g_quantum, .burst = 1 };
+			ret = ioctl(fd, SCULL_IOCSRATE, &rate);
+			if (ret != 0)
+				break;
+			for (int i = 0; i < 100; i++) {
+				ioctl(fd, SCULL_IOCIQUANTUM, &tmp);
+			}
+			ret = ioctl(fd, SCULL_IOCGRATE, &rate);
+			if (ret == 0)
+				printf("rate %u, burst %u, throttled %lu\n",
+				       rate.rate, rate.burst, rate.throttled);
+			break;
+		}
+	case 'f':
+		{ /* Children register through the driver without calling ioctl */
+			ret = ioctl(fd, SCULL_IOCTFOLLOW, 1);
+			if (ret != 0)
+				break;
+			for (int i = 0; i < NUM_CHILDREN; i++) {
+				pid_t pid = fork();
+				if (pid == -1) {
+					perror("fork");
+					exit(EXIT_FAILURE);
+				}
+				if (pid == 0)
+					exit(EXIT_SUCCESS);
+				printf("forked %i\n", pid);
+			}
+			for (int i = 0; i < NUM_CHILDREN; i++) {
+				wait(NULL);
+			}
+			ret = ioctl(fd, SCULL_IOCTFOLLOW, 0);
+			break;
+		}
 
 	default:
 		/* Should never occur */
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "scull_decode.h"
+
+/* Reference decoder for SCULL_IOCZEXPORT, see the format in scull.h */
+
+static int get_varint(const unsigned char **p, const unsigned char *end,
+		      unsigned long long *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		unsigned char b = *(*p)++;
+		*v |= (unsigned long long)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static long long unzigzag(unsigned long long v)
+{
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+int scull_zdecode(struct scull_zmirror *m, const struct scull_zexport *ex,
+		  struct task_info *out)
+{
+	const unsigned char *p = ex->buf, *end = ex->buf + ex->size;
+	unsigned int nprev = (ex->flags & SCULL_Z_KEYFRAME) ? 0 : m->n;
+	unsigned long long v[7];
+	struct task_info *recs;
+	unsigned int i, j = 0;
+	pid_t pid = 0;
+
+	for (i = 0; i < ex->count; i++) {
+		unsigned long base_nv = 0, base_niv = 0;
+
+		for (int k = 0; k < 7; k++) {
+			if (get_varint(&p, end, &v[k]))
+				return -1;
+		}
+		pid += v[0];
+		while (j < nprev && m->recs[j].pid < pid)
+			j++;
+		if (j < nprev && m->recs[j].pid == pid) {
+			base_nv = m->recs[j].nvcsw;
+			base_niv = m->recs[j].nivcsw;
+		}
+		out[i].pid = pid;
+		out[i].tgid = pid + unzigzag(v[1]);
+		out[i].state = unzigzag(v[2]);
+		out[i].cpu = v[3];
+		out[i].prio = unzigzag(v[4]);
+		out[i].nvcsw = base_nv + unzigzag(v[5]);
+		out[i].nivcsw = base_niv + unzigzag(v[6]);
+	}
+	if (p != end)
+		return -1;
+
+	recs = realloc(m->recs, (ex->count ? ex->count : 1) * sizeof(*recs));
+	if (!recs)
+		return -1;
+	memcpy(recs, out, ex->count * sizeof(*recs));
+	m->recs = recs;
+	m->n = ex->count;
+	return 0;
+}
+
+void scull_zmirror_free(struct scull_zmirror *m)
+{
+	free(m->recs);
+	m->recs = NULL;
+	m->n = 0;
+}
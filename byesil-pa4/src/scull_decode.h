@@ -0,0 +1,26 @@
+#ifndef _SCULL_DECODE_H_
+#define _SCULL_DECODE_H_
+
+#include <sys/types.h>
+#include "scull.h"
+
+/*
+ * Decoder state for one fd and source: the counters of the previous
+ * export, which the next one is delta-coded against.
+ */
+struct scull_zmirror {
+	struct task_info *recs;
+	unsigned int n;
+};
+
+/*
+ * Decode the export ex (as returned by SCULL_IOCZEXPORT) into out, which
+ * must hold ex->count records, and remember it in m for the next one.
+ * Returns 0, or -1 if the buffer is malformed or cannot be remembered.
+ */
+int scull_zdecode(struct scull_zmirror *m, const struct scull_zexport *ex,
+		  struct task_info *out);
+
+void scull_zmirror_free(struct scull_zmirror *m);
+
+#endif /* _SCULL_DECODE_H_ */